@@ -1,247 +1,113 @@
-#include <config.h>
 #include <raylib.h>
 #include <raymath.h>
-#include <rlgl.h>
+#include <external/stb_rect_pack.h>
+
+#include "bsp.h"
+#include "bsp_file.h"
+#include "mapped_file.h"
+#include "thread_pool.h"
 
 #include <algorithm>
+#include <charconv>
+#include <cmath>
 #include <filesystem>
-#include <fstream>
-#include <iomanip>
+#include <limits>
 #include <set>
 #include <span>
+#include <stdexcept>
 #include <unordered_map>
 #include <vector>
 
 #include <assert.h>
-
-template<typename T>
-T
-ReadT(std::istream& stream)
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define PALETTE_AVX2 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+static bool
+IsEntitySpace(char c)
 {
-	T data{};
-	stream.read((char*)&data, sizeof(T));
-	return data;
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
 }
 
-template<typename T>
-T
-ReadT(std::istream& stream, size_t idx)
-{
-	stream.seekg(idx * sizeof(T), std::ios::cur);
-	return ReadT<T>(stream);
-}
-
-#pragma pack(push, 1)
-
-struct Color_RGB8
-{
-	uint8_t r, g, b;
-};
-
-Color_RGB8
-palette(uint8_t id);
-
-struct Vector3S
-{
-	int16_t x, y, z;
-};
-
-struct BoundingBoxS // Bounding Box, Short values
+Entity_List
+ParseEntities(std::string_view text)
 {
-	Vector3S min, max;
-};
+	Entity_List entities{};
+	size_t pos = 0;
 
-struct Dir_Entry // A Directory entry
-{
-	int32_t offset; // Offset to entry, in bytes, from start of file
-	int32_t size;   // Size of entry in file, in bytes
-};
-
-struct Header // The BSP file header
-{
-	int32_t version; // Model version, must be 0x17 (23).
-
-	Dir_Entry entities;   // List of Entities.
-	Dir_Entry planes;     // Map Planes.
-						  // numplanes = size/sizeof(plane_t)
-	Dir_Entry miptex;     // Wall Textures.
-	Dir_Entry vertices;   // Map Vertices.
-						  // numvertices = size/sizeof(vertex_t)
-	Dir_Entry visibility; // Leaves Visibility lists.
-	Dir_Entry nodes;      // BSP Nodes.
-						  // numnodes = size/sizeof(node_t)
-	Dir_Entry texinfos;   // Texture Info for faces.
-						  // numtexinfo = size/sizeof(texinfo_t)
-	Dir_Entry faces;      // Faces of each surface.
-						  // numfaces = size/sizeof(face_t)
-	Dir_Entry lightmaps;  // Wall Light Maps.
-	Dir_Entry clipnodes;  // clip nodes, for Models.
-						  // numclips = size/sizeof(clipnode_t)
-	Dir_Entry leaves;     // BSP Leaves.
-						  // numleaves = size/sizeof(leaf_t)
-	Dir_Entry listfaces;  // List of Faces.
-	Dir_Entry edges;      // Edges of faces.
-						  // numedges = size/sizeof(edge_t)
-	Dir_Entry listedges;  // List of Edges.
-	Dir_Entry models;     // List of Models.
-						  // nummodels = Size/sizeof(model_t)
-};
-
-struct Entity
-{
-	std::unordered_map<std::string, std::string> tags;
-};
-
-struct BSP_Model
-{
-	BoundingBox bound;    // The bounding box of the Model
-	Vector3 origin;       // origin of model, usually (0,0,0)
-	int32_t bsp_node_id;  // index of first BSP node
-	int32_t clipnode1_id; // index of the first Clip node
-	int32_t clipnode2_id; // index of the second Clip node
-	int32_t _dummy_id;    // usually zero
-	int32_t numleafs;     // number of BSP leaves
-	int32_t face_id;      // index of Faces
-	int32_t face_num;     // number of Faces
-};
-
-struct Edge
-{
-	uint16_t vs; // index of the start vertex
-		//  must be in [0,numvertices[
-	uint16_t ve; // index of the end vertex
-				 //  must be in [0,numvertices[
-};
+	// Tokens are braces, quoted strings or bare words, with // comments running to the end of the line
+	auto next_token = [&]() -> std::string_view {
+		while (pos < text.size())
+		{
+			if (IsEntitySpace(text[pos]))
+				++pos;
+			else if (text.substr(pos, 2) == "//")
+				pos = std::min(text.find('\n', pos), text.size());
+			else
+				break;
+		}
+		if (pos == text.size())
+			return {};
 
-struct Plane
-{
-	Vector3 normal; // Vector orthogonal to plane (Nx,Ny,Nz)
-	float dist;     // Offset to plane, along the normal vector.
-	int32_t type;   // Type of plane, depending on normal vector.
-};
+		size_t start = pos;
+		if (text[pos] == '{' || text[pos] == '}')
+			return text.substr(pos++, 1);
 
-struct TexInfo
-{
-	Vector3 u_axis;     // U vector, horizontal in texture space)
-	float u_offset;     // horizontal offset in texture space
-	Vector3 v_axis;     // V vector, vertical in texture space
-	float v_offset;     // vertical offset in texture space
-	uint32_t miptex_id; // Index of Mip Texture
-						//           must be in [0,numtex[
-	uint32_t animated;  // 0 for ordinary textures, 1 for water
-};
-
-struct Face
-{
-	uint16_t plane_id;   // The plane in which the face lies
-						 //           must be in [0,numplanes[
-	uint16_t side;       // 0 if in front of the plane, 1 if behind the plane
-	int32_t ledge_id;    // first edge in the List of edges
-						 //           must be in [0,numledges[
-	uint16_t ledge_num;  // number of edges in the List of edges
-	uint16_t texinfo_id; // index of the Texture info the face is part of
-						 //           must be in [0,numtexinfos[
-	uint8_t typelight;   // type of lighting, for the face
-	uint8_t baselight;   // from 0xFF (dark) to 0 (bright)
-	uint8_t light[2];    // two additional light models
-	uint32_t lightmap;   // Pointer inside the general light map, or -1
-						 // this define the start of the face light map
-};
-
-struct Miptex // Mip Texture
-{
-	char name[16];      // Name of the texture.
-	uint32_t width;     // width of picture, must be a multiple of 8
-	uint32_t height;    // height of picture, must be a multiple of 8
-	uint32_t offset[4]; // offsets to uint8_t Pix[width * height], relative to start of Miptex
-};
-
-/**
-* typedef struct                 // Mip texture list header
-* { int32_t numtex;                 // Number of textures in Mip Texture list
-*   int32_t offset[numtex];         // Offset to each of the individual texture from the beginning of mipheader_t
-* } mipheader_t;
-*/
-
-struct Node
-{
-	uint32_t plane_id; // The plane that splits the node
-					   //           must be in [0,numplanes[
-	int16_t front;     // If > 0,  front = index of Front child node
-					   // else,   ~front = index of child leaf
-	int16_t back;      // If > 0,   back = index of Back child node
-					   // else,    ~back = index of child leaf
-	BoundingBoxS box;  // Bounding box of node and all childs
-	uint16_t face_id;  // Index of first Polygons in the node
-	uint16_t face_num; // Number of faces in the node
-};
-
-struct Leaf
-{
-	int32_t type;          // Special type of leaf
-	int32_t visibility_id; // Beginning of visibility lists
-						   //     must be -1 or in [0,numvislist[
-	BoundingBoxS bound;    // Bounding box of the leaf
-	uint16_t listface_id;  // First item of the list of faces
-						   //     must be in [0,numlfaces[
-	uint16_t listface_num; // Number of faces in the leaf
-	uint8_t sndwater;      // level of the four ambient sounds:
-	uint8_t sndsky;        //   0    is no sound
-	uint8_t sndslime;      //   0xFF is maximum volume
-	uint8_t sndlava;       //
-};
-
-// uint16_t listface[numlface];   // each uint16_t is the index of a Face
-
-// int32_t listedge[numlstedge];
-
-// uint8_t vislist[numvislist];    // RLE encoded bit array
-
-struct Clipnode
-{
-	uint32_t planenum; // The plane which splits the node
-	int16_t front;     // If positive, id of Front child node
-					   // If -2, the Front part is inside the model
-					   // If -1, the Front part is outside the model
-	int16_t back;      // If positive, id of Back child node
-					   // If -2, the Back part is inside the model
-					   // If -1, the Back part is outside the model
-};
-
-// uint8_t lightmap[numlightmap]; // value 0:dark 255:bright
-
-// uint8_t light[width*height];
-#pragma pack(pop)
-
-static Entity
-ReadEntity(std::istream& stream)
-{
-	Entity entity{};
+		if (text[pos] == '"')
+		{
+			size_t end = text.find('"', start + 1);
+			if (end == std::string_view::npos)
+				throw std::runtime_error("Unterminated string in entities");
+			pos = end + 1;
+			return text.substr(start, pos - start);
+		}
 
-	char token;
-	stream >> token;
-	if (token != '{')
-		throw TextFormat("Expected ')', found %c", token);
+		while (pos < text.size() && IsEntitySpace(text[pos]) == false && text[pos] != '{' && text[pos] != '}' && text[pos] != '"')
+			++pos;
+		return text.substr(start, pos - start);
+	};
+	auto unquote = [](std::string_view token) {
+		return token.starts_with('"') ? token.substr(1, token.size() - 2) : token;
+	};
 
-	while (stream >> std::ws)
+	for (std::string_view token = next_token(); token.empty() == false; token = next_token())
 	{
-		token = stream.peek();
-		if (token == '"')
+		if (token != "{")
 		{
-			std::string tag, tagValue;
-			stream >> std::quoted(tag) >> std::quoted(tagValue);
-			entity.tags[tag] = tagValue;
+			// Loads run on other threads, the shared buffer of TextFormat can't be used
+			char message[128];
+			snprintf(message, sizeof(message), "Expected '{' in entities, found '%.*s'", (int)token.size(), token.data());
+			throw std::runtime_error(message);
 		}
-		else if (token == '}')
+
+		uint32_t entity_id = entities.size();
+		for (token = next_token(); token != "}"; token = next_token())
 		{
-			stream >> token;
-			break;
+			if (token.empty() || token == "{")
+				throw std::runtime_error("Expected '}' in entities");
+
+			std::string_view value = next_token();
+			if (value.empty() || value == "{" || value == "}")
+				throw std::runtime_error("Expected a value in entities");
+
+			Entity_Field& field = entities.fields.emplace_back(unquote(token), unquote(value));
+			if (field.key == "classname")
+				entities.classnames[field.value].push_back(entity_id);
 		}
-		else
-			throw TextFormat("Expected ')', found %c", token);
+		entities.entity_fields.push_back(entities.fields.size());
 	}
 
-	return entity;
+	return entities;
 }
 
 Vector3
@@ -250,242 +116,583 @@ FromQuake(Vector3 quakeVec)
 	return Vector3Scale({quakeVec.y, quakeVec.z, quakeVec.x}, 0.05f);
 }
 
-struct BSP_File
+Vector3
+ToQuake(Vector3 vec)
 {
-	std::istream& bsp_file;
-	Header header;
+	return Vector3Scale({vec.z, vec.x, vec.y}, 1.f / 0.05f);
+}
 
-	BSP_File(std::ifstream& _file) : bsp_file(_file)
-	{
-		if (bsp_file.good() == false)
-			throw std::runtime_error("Failed to open file");
 
-		header = ReadT<Header>(bsp_file);
-	}
-
-	template<typename T>
-	T
-	_read(Dir_Entry dir, size_t idx)
+Map_Arrays
+DecodeMapArrays(BSP_File& map)
+{
+	Map_Arrays arrays{};
+	arrays.vertices.assign(map.vertices.begin(), map.vertices.end());
+
+	size_t miptex_count = map.miptex_count();
+	arrays.miptex_widths.resize(miptex_count);
+	arrays.miptex_heights.resize(miptex_count);
+	arrays.miptex_groups.resize(miptex_count);
+	std::unordered_map<std::string, uint32_t> name_groups{};
+	for (size_t i = 0; i < miptex_count; ++i)
 	{
-		assert(idx < dir.size / sizeof(T));
-		bsp_file.clear();
-		bsp_file.seekg(dir.offset);
-		return ReadT<T>(bsp_file, idx);
+		arrays.miptex_groups[i] = i;
+		if (map.miptex_offsets[i] == -1)
+			continue;
+
+		Miptex miptex = map.miptex(i);
+		arrays.miptex_widths[i] = miptex.width;
+		arrays.miptex_heights[i] = miptex.height;
+		arrays.miptex_groups[i] = name_groups.try_emplace(std::string(miptex.name, strnlen(miptex.name, sizeof(miptex.name))), i).first->second;
 	}
 
-	std::vector<Entity>
-	entities()
+	size_t texinfo_count = map.texinfos.size();
+	arrays.texinfo_u_axes.reserve(texinfo_count);
+	arrays.texinfo_v_axes.reserve(texinfo_count);
+	arrays.texinfo_u_offsets.reserve(texinfo_count);
+	arrays.texinfo_v_offsets.reserve(texinfo_count);
+	arrays.texinfo_flags.reserve(texinfo_count);
+	arrays.texinfo_miptex_ids.reserve(texinfo_count);
+	for (const TexInfo& texinfo : map.texinfos)
 	{
-		bsp_file.clear();
-		bsp_file.seekg(header.entities.offset);
-
-		std::vector<Entity> entities{};
-		while (bsp_file.tellg() < header.entities.offset + header.entities.size)
-			entities.push_back(ReadEntity(bsp_file));
-
-		return entities;
+		if (texinfo.miptex_id >= miptex_count)
+			throw std::runtime_error("Texinfo miptex out of bounds");
+		arrays.texinfo_u_axes.push_back(texinfo.u_axis);
+		arrays.texinfo_v_axes.push_back(texinfo.v_axis);
+		arrays.texinfo_u_offsets.push_back(texinfo.u_offset);
+		arrays.texinfo_v_offsets.push_back(texinfo.v_offset);
+		arrays.texinfo_flags.push_back(texinfo.animated);
+		arrays.texinfo_miptex_ids.push_back(texinfo.miptex_id);
 	}
 
-	Plane
-	plane(size_t idx)
+	size_t face_count = map.faces.size();
+	arrays.face_first_vertices.reserve(face_count);
+	arrays.face_vertex_counts.reserve(face_count);
+	arrays.face_texinfo_ids.reserve(face_count);
+	arrays.face_miptex_ids.reserve(face_count);
+	arrays.face_plane_ids.reserve(face_count);
+	arrays.face_sides.reserve(face_count);
+	arrays.face_normals.reserve(face_count);
+	arrays.face_lightmaps.reserve(face_count);
+	arrays.face_vertices.reserve(map.listedges.size());
+	for (const Face& face : map.faces)
 	{
-		return _read<Plane>(header.planes, idx);
+		if (face.plane_id >= map.planes.size() || face.texinfo_id >= texinfo_count)
+			throw std::runtime_error("Face out of bounds");
+		if (face.ledge_id < 0 || (size_t)face.ledge_id + face.ledge_num > map.listedges.size())
+			throw std::runtime_error("Face edges out of bounds");
+		if (face.ledge_num < 3)
+			throw std::runtime_error("Face with fewer than 3 edges");
+
+		arrays.face_first_vertices.push_back(arrays.face_vertices.size());
+		for (int32_t ledge : map.listedges.subspan(face.ledge_id, face.ledge_num))
+		{
+			if ((size_t)labs(ledge) >= map.edges.size())
+				throw std::runtime_error("Edge out of bounds");
+			Edge edge = map.edges[labs(ledge)];
+			uint16_t vertex_id = ledge >= 0 ? edge.vs : edge.ve;
+			if (vertex_id >= map.vertices.size())
+				throw std::runtime_error("Vertex out of bounds");
+			arrays.face_vertices.push_back(vertex_id);
+		}
+		arrays.face_vertex_counts.push_back(face.ledge_num);
+
+		Vector3 normal = map.planes[face.plane_id].normal;
+		if (face.side != 0)
+			normal = Vector3Negate(normal);
+
+		arrays.face_texinfo_ids.push_back(face.texinfo_id);
+		arrays.face_miptex_ids.push_back(map.texinfos[face.texinfo_id].miptex_id);
+		arrays.face_plane_ids.push_back(face.plane_id);
+		arrays.face_sides.push_back(face.side != 0);
+		arrays.face_normals.push_back(Vector3Normalize(FromQuake(normal)));
+		arrays.face_lightmaps.push_back(face.lightmap);
 	}
 
-	int32_t
-	miptex_count()
+	return arrays;
+}
+
+std::vector<Texture_Projection>
+TextureProjections(const Map_Arrays& arrays)
+{
+	std::vector<Texture_Projection> projections{};
+	projections.reserve(arrays.texinfo_u_axes.size());
+	for (size_t i = 0; i < arrays.texinfo_u_axes.size(); ++i)
 	{
-		bsp_file.clear();
-		bsp_file.seekg(header.miptex.offset);
-		return ReadT<int32_t>(bsp_file);
+		// Missing textures are 0x0, their faces are never drawn
+		float width = std::max<uint32_t>(arrays.miptex_widths[arrays.texinfo_miptex_ids[i]], 1);
+		float height = std::max<uint32_t>(arrays.miptex_heights[arrays.texinfo_miptex_ids[i]], 1);
+		Vector3 s = Vector3Scale(arrays.texinfo_u_axes[i], 1 / width), t = Vector3Scale(arrays.texinfo_v_axes[i], 1 / height);
+		projections.push_back({
+			.s = {s.x, s.y, s.z, arrays.texinfo_u_offsets[i] / width},
+			.t = {t.x, t.y, t.z, arrays.texinfo_v_offsets[i] / height},
+		});
 	}
+	return projections;
+}
+
+constexpr uint32_t TEX_SPECIAL = 1; // TexInfo flag of sky and liquids, drawn without a lightmap
+constexpr int LUXEL_SIZE = 16;      // Texels covered by one lightmap sample
 
-	Miptex
-	miptex(size_t idx)
+static Face_Lightmap
+FaceLightmapExtents(const Map_Arrays& arrays, std::span<const uint8_t> lightmap_lump, uint32_t face_id)
+{
+	uint16_t texinfo_id = arrays.face_texinfo_ids[face_id];
+	Vector3 u_axis = arrays.texinfo_u_axes[texinfo_id], v_axis = arrays.texinfo_v_axes[texinfo_id];
+	float u_offset = arrays.texinfo_u_offsets[texinfo_id], v_offset = arrays.texinfo_v_offsets[texinfo_id];
+
+	// The lightmap covers the face bounds in texture space, snapped outwards to whole luxels
+	float mins[2] = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+	float maxs[2] = {std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+	for (uint16_t vertex_id : arrays.face_vertices_of(face_id))
 	{
-		int32_t count = miptex_count();
-		int32_t offset = ReadT<int32_t>(bsp_file, idx);
+		Vector3 vertex = arrays.vertices[vertex_id];
 
-		bsp_file.seekg(header.miptex.offset + offset);
-		return ReadT<Miptex>(bsp_file);
+		float st[2] = {Vector3DotProduct(vertex, u_axis) + u_offset, Vector3DotProduct(vertex, v_axis) + v_offset};
+		for (int axis = 0; axis < 2; ++axis)
+		{
+			mins[axis] = std::min(mins[axis], st[axis]);
+			maxs[axis] = std::max(maxs[axis], st[axis]);
+		}
 	}
 
-	Vector3
-	vertex(size_t idx)
+	Face_Lightmap lightmap{.offset = arrays.face_lightmaps[face_id]};
+	int size[2];
+	for (int axis = 0; axis < 2; ++axis)
 	{
-		return _read<Vector3>(header.vertices, idx);
+		lightmap.texture_mins[axis] = (int)std::floor(mins[axis] / LUXEL_SIZE);
+		size[axis] = (int)std::ceil(maxs[axis] / LUXEL_SIZE) - lightmap.texture_mins[axis] + 1;
 	}
+	lightmap.width = size[0];
+	lightmap.height = size[1];
+
+	if ((arrays.texinfo_flags[texinfo_id] & TEX_SPECIAL) != 0)
+		lightmap.offset = -1;
+	if (lightmap.offset >= 0 && (size_t)lightmap.offset + (size_t)lightmap.width * lightmap.height > lightmap_lump.size())
+		throw std::runtime_error("Lightmap out of bounds");
+	return lightmap;
+}
 
-	Node
-	node(size_t idx)
-	{
-		return _read<Node>(header.nodes, idx);
-	}
+// Packs the first lightmap of every face into one atlas. Faces without one point at a single constant luxel,
+// dark when the map has lighting and full bright for sky, liquids and maps that were never lit.
+Lightmap_Data
+PackLightmaps(const Map_Arrays& arrays, std::span<const uint8_t> lightmap_lump, std::span<const uint32_t> face_ids,
+			  std::vector<Face_Lightmap>& face_lightmaps)
+{
+	face_lightmaps.resize(arrays.face_count());
 
-	TexInfo
-	texinfo(size_t idx)
+	const int DARK = -1, FULL_BRIGHT = -2;
+	std::vector<stbrp_rect> rects{{.id = DARK, .w = 1, .h = 1}, {.id = FULL_BRIGHT, .w = 1, .h = 1}};
+	size_t area = 2;
+	for (uint32_t face_id : face_ids)
 	{
-		return _read<TexInfo>(header.texinfos, idx);
-	}
+		Face_Lightmap& lightmap = face_lightmaps[face_id] = FaceLightmapExtents(arrays, lightmap_lump, face_id);
+		if (lightmap.offset < 0)
+			continue;
 
-	Face
-	face(size_t idx)
-	{
-		return _read<Face>(header.faces, idx);
+		rects.push_back({.id = (int)face_id, .w = lightmap.width, .h = lightmap.height});
+		area += (size_t)lightmap.width * lightmap.height;
 	}
 
-	Leaf
-	leaf(size_t idx)
-	{
-		return _read<Leaf>(header.leaves, idx);
-	}
+	// Start from the smallest square that could fit and grow it until everything does
+	Lightmap_Data atlas{.width = 1, .height = 1};
+	while ((size_t)atlas.width * atlas.height < area)
+		(atlas.width <= atlas.height ? atlas.width : atlas.height) *= 2;
 
-	uint16_t
-	listface(size_t idx)
+	std::vector<stbrp_node> nodes;
+	while (true)
 	{
-		return _read<uint16_t>(header.listfaces, idx);
-	}
+		if (atlas.width > 16384 || atlas.height > 16384)
+			throw std::runtime_error("Lightmaps do not fit in an atlas");
 
-	Edge
-	edge(size_t idx)
-	{
-		return _read<Edge>(header.edges, idx);
+		nodes.resize(atlas.width);
+		stbrp_context context;
+		stbrp_init_target(&context, atlas.width, atlas.height, nodes.data(), nodes.size());
+		if (stbrp_pack_rects(&context, rects.data(), rects.size()) != 0)
+			break;
+		(atlas.width <= atlas.height ? atlas.width : atlas.height) *= 2;
 	}
 
-	int32_t
-	listedge(size_t idx)
+	// Sampling stays within half a luxel of the edges of each rectangle, so no border is needed between them
+	atlas.pixels.resize((size_t)atlas.width * atlas.height);
+	Face_Lightmap constant_luxels[2];
+	for (const stbrp_rect& rect : rects)
 	{
-		return _read<int32_t>(header.listedges, idx);
-	}
+		if (rect.id < 0)
+		{
+			bool full_bright = rect.id == FULL_BRIGHT || lightmap_lump.empty();
+			atlas.pixels[(size_t)rect.y * atlas.width + rect.x] = full_bright ? 128 : 0;
+			constant_luxels[rect.id == FULL_BRIGHT] = {.offset = -1, .width = 1, .height = 1, .x = rect.x, .y = rect.y};
+			continue;
+		}
 
-	BSP_Model
-	model(size_t idx)
-	{
-		return _read<BSP_Model>(header.models, idx);
+		Face_Lightmap& lightmap = face_lightmaps[rect.id];
+		lightmap.x = rect.x;
+		lightmap.y = rect.y;
+		for (int row = 0; row < rect.h; ++row)
+		{
+			const uint8_t* src = lightmap_lump.data() + lightmap.offset + (size_t)row * rect.w;
+			std::copy(src, src + rect.w, atlas.pixels.begin() + (size_t)(rect.y + row) * atlas.width + rect.x);
+		}
 	}
 
-	std::vector<Color_RGB8>
-	miptex_data(size_t idx, uint8_t miplevel)
+	for (uint32_t face_id : face_ids)
 	{
-		Miptex mptx = miptex(idx);
-
-		uint32_t width = mptx.width >> miplevel;
-		uint32_t height = mptx.height >> miplevel;
+		Face_Lightmap& lightmap = face_lightmaps[face_id];
+		if (lightmap.offset >= 0)
+			continue;
 
-		bsp_file.seekg(-sizeof(Miptex) + mptx.offset[miplevel], std::ios::cur);
-
-		std::vector<uint8_t> palette_indices(width * height);
-		bsp_file.read((char*)palette_indices.data(), width * height);
-
-		std::vector<Color_RGB8> color_data;
-		std::transform(palette_indices.begin(), palette_indices.end(), std::back_inserter(color_data), palette);
-		return color_data;
+		uint32_t flags = arrays.texinfo_flags[arrays.face_texinfo_ids[face_id]];
+		bool full_bright = (flags & TEX_SPECIAL) != 0 || lightmap_lump.empty();
+		lightmap = constant_luxels[full_bright];
 	}
-};
 
-Vector3
-VerticesNormal(Vector3 a, Vector3 b, Vector3 c)
-{
-	Vector3 ba = Vector3Subtract(b, a);
-	Vector3 ca = Vector3Subtract(c, a);
-	return Vector3Normalize(Vector3CrossProduct(ba, ca));
+	return atlas;
 }
 
-Mesh
-GenMeshFaces(BSP_File& map, std::span<const Face> faces)
+static Vector2
+LightmapTexcoord(const Face_Lightmap& lightmap, const Lightmap_Data& atlas, float s, float t)
 {
-	static_assert(sizeof(Vector3) == 3 * sizeof(float));
-	static_assert(sizeof(Vector2) == 2 * sizeof(float));
-	std::vector<Vector3> vertices{};
-	std::vector<Vector2> texcoords{};
-	std::vector<Vector3> normals{};
+	// Vertices map to luxel centers, which sit every 16 texels from the snapped face bounds
+	float u = lightmap.offset >= 0 ? s / LUXEL_SIZE - lightmap.texture_mins[0] : 0;
+	float v = lightmap.offset >= 0 ? t / LUXEL_SIZE - lightmap.texture_mins[1] : 0;
+	return {(lightmap.x + u + 0.5f) / atlas.width, (lightmap.y + v + 0.5f) / atlas.height};
+}
 
-	for (const Face& face : faces)
-	{
-		TexInfo texinfo = map.texinfo(face.texinfo_id);
-		Miptex miptex = map.miptex(texinfo.miptex_id);
+Mesh_Data
+GenMeshFaces(const Map_Arrays& arrays, std::span<const uint32_t> face_ids, uint16_t texture_id, std::span<const Face_Lightmap> face_lightmaps,
+			 const Lightmap_Data& atlas, std::vector<Draw_Range>& face_ranges)
+{
+	Mesh_Data mesh{};
+	auto& [vertices, texcoords, lightmap_texcoords, normals, texture_ids, texinfo_ids, indices, soup_vertex_count] = mesh;
 
-		std::vector<Vector3> face_vertices{};
-		std::vector<Vector2> face_texcoords{};
+	// Faces sharing a BSP vertex, a texinfo and a plane side produce the exact same vertex.
+	// The plane is part of the key since a texinfo can be shared by faces with different normals.
+	// Each lightmap has its own place in the atlas, so lit faces only weld with themselves.
+	std::unordered_map<uint64_t, uint32_t> welded_vertices{};
+	std::vector<uint32_t> face_indices{};
 
-		for (size_t i = 0; i < face.ledge_num; ++i)
+	for (uint32_t face_id : face_ids)
+	{
+		uint16_t texinfo_id = arrays.face_texinfo_ids[face_id];
+		Vector3 u_axis = arrays.texinfo_u_axes[texinfo_id], v_axis = arrays.texinfo_v_axes[texinfo_id];
+		float u_offset = arrays.texinfo_u_offsets[texinfo_id], v_offset = arrays.texinfo_v_offsets[texinfo_id];
+		uint32_t miptex_id = arrays.face_miptex_ids[face_id];
+		uint32_t width = arrays.miptex_widths[miptex_id], height = arrays.miptex_heights[miptex_id];
+		uint64_t plane_key = uint64_t(arrays.face_plane_ids[face_id]) << 32 | uint64_t(arrays.face_sides[face_id]) << 48;
+		Vector3 normal = arrays.face_normals[face_id];
+		const Face_Lightmap& lightmap = face_lightmaps[face_id];
+		uint32_t first_index = indices.size();
+
+		face_indices.clear();
+		for (uint16_t vertex_id : arrays.face_vertices_of(face_id))
 		{
-			int16_t ledge = map.listedge(face.ledge_id + i);
-			Edge edge = map.edge(labs(ledge));
-
-			Vector3 vertex = map.vertex(ledge >= 0 ? edge.vs : edge.ve);
-			face_vertices.push_back(vertex);
-
-			Vector2 uv{
-				.x = (Vector3DotProduct(vertex, texinfo.u_axis) + texinfo.u_offset) / miptex.width,
-				.y = (Vector3DotProduct(vertex, texinfo.v_axis) + texinfo.v_offset) / miptex.height,
-			};
-			face_texcoords.push_back(uv);
+			uint64_t key = uint64_t(vertex_id) | uint64_t(texinfo_id) << 16 | plane_key;
+			if (lightmap.offset >= 0)
+				key = uint64_t(vertex_id) | uint64_t(face_id) << 16 | uint64_t(1) << 49;
+			auto [it, inserted] = welded_vertices.try_emplace(key, vertices.size());
+			if (inserted)
+			{
+				Vector3 vertex = arrays.vertices[vertex_id];
+				float s = Vector3DotProduct(vertex, u_axis) + u_offset;
+				float t = Vector3DotProduct(vertex, v_axis) + v_offset;
+				vertices.push_back(FromQuake(vertex));
+				texcoords.push_back({s / width, t / height});
+				lightmap_texcoords.push_back(LightmapTexcoord(lightmap, atlas, s, t));
+				normals.push_back(normal);
+				texture_ids.push_back(texture_id);
+				texinfo_ids.push_back(texinfo_id);
+			}
+			face_indices.push_back(it->second);
 		}
-		assert(face_vertices.empty() == false);
+		assert(face_indices.size() >= 3); // DecodeMapArrays rejects faces with fewer edges
 
-		for (size_t i = face_vertices.size() - 2; i > 0; --i)
+		for (size_t i = face_indices.size() - 2; i > 0; --i)
 		{
-			Vector3 v[3] = {
-				FromQuake(face_vertices.back()),
-				FromQuake(face_vertices[i]),
-				FromQuake(face_vertices[i - 1]),
-			};
-			vertices.insert(vertices.end(), std::begin(v), std::end(v));
-
-			texcoords.push_back(face_texcoords.back());
-			texcoords.push_back(face_texcoords[i]);
-			texcoords.push_back(face_texcoords[i - 1]);
-
-			Vector3 normal = VerticesNormal(v[0], v[1], v[2]);
-			for (size_t v = 0; v < 3; ++v)
-				normals.push_back(normal);
+			indices.push_back(face_indices.back());
+			indices.push_back(face_indices[i]);
+			indices.push_back(face_indices[i - 1]);
 		}
+		soup_vertex_count += 3 * (face_indices.size() - 2);
+
+		face_ranges.push_back({
+			.texture_id = texture_id,
+			.first_index = first_index,
+			.index_count = (uint32_t)indices.size() - first_index,
+		});
 	}
 
-	Mesh mesh{};
-	mesh.vertexCount = vertices.size();
-	mesh.vertices = (float*)vertices.data();
-	mesh.texcoords = (float*)texcoords.data();
-	mesh.normals = (float*)normals.data();
-	UploadMesh(&mesh, false);
-
-	// So the free functions don't complain later on
-	mesh.vertices = (float*)malloc(1);
-	mesh.texcoords = (float*)malloc(1);
-	mesh.normals = (float*)malloc(1);
 	return mesh;
 }
 
-std::vector<Model>
-LoadModelsFromBSPFile(const std::filesystem::path& path)
+void
+AppendMeshData(Mesh_Data& mesh, const Mesh_Data& other)
 {
-	std::ifstream bsp_file{path, std::ios::binary};
-	BSP_File map{bsp_file};
+	uint32_t base_vertex = mesh.vertices.size();
+	mesh.vertices.insert(mesh.vertices.end(), other.vertices.begin(), other.vertices.end());
+	mesh.texcoords.insert(mesh.texcoords.end(), other.texcoords.begin(), other.texcoords.end());
+	mesh.lightmap_texcoords.insert(mesh.lightmap_texcoords.end(), other.lightmap_texcoords.begin(), other.lightmap_texcoords.end());
+	mesh.normals.insert(mesh.normals.end(), other.normals.begin(), other.normals.end());
+	mesh.texture_ids.insert(mesh.texture_ids.end(), other.texture_ids.begin(), other.texture_ids.end());
+	mesh.texinfo_ids.insert(mesh.texinfo_ids.end(), other.texinfo_ids.begin(), other.texinfo_ids.end());
+	for (uint32_t index : other.indices)
+		mesh.indices.push_back(base_vertex + index);
+	mesh.soup_vertex_count += other.soup_vertex_count;
+}
 
-	Node bsp_root = map.node(map.model(0).bsp_node_id);
-	std::vector<Node> nodes{bsp_root};
+static uint16_t
+QuantizeUnorm(float value)
+{
+	return (uint16_t)std::lround(std::clamp(value, 0.0f, 1.0f) * 65535);
+}
+
+// Folds the lower half of the octahedron over the upper one, so a unit vector takes two numbers
+static Vector2
+OctahedralEncode(Vector3 n)
+{
+	Vector2 p = Vector2Scale({n.x, n.y}, 1 / (fabsf(n.x) + fabsf(n.y) + fabsf(n.z)));
+	if (n.z < 0)
+		p = {(1 - fabsf(p.y)) * (p.x >= 0 ? 1 : -1), (1 - fabsf(p.x)) * (p.y >= 0 ? 1 : -1)};
+	return p;
+}
+
+Packed_Mesh
+PackMesh(const Mesh_Data& mesh, std::span<const Texture_Projection> texture_projections)
+{
+	Packed_Mesh packed{};
+	packed.bounds = {mesh.vertices.empty() ? Vector3Zero() : mesh.vertices[0], mesh.vertices.empty() ? Vector3Zero() : mesh.vertices[0]};
+	for (Vector3 vertex : mesh.vertices)
+	{
+		packed.bounds.min = Vector3Min(packed.bounds.min, vertex);
+		packed.bounds.max = Vector3Max(packed.bounds.max, vertex);
+	}
+	Vector3 size = Vector3Subtract(packed.bounds.max, packed.bounds.min);
+	size = {std::max(size.x, 1e-6f), std::max(size.y, 1e-6f), std::max(size.z, 1e-6f)};
+
+	// Texture coordinates are projected from the packed position, which goes from 0 to 1 between the bounds
+	Vector3 quake_min = ToQuake(packed.bounds.min);
+	Vector3 quake_axes[3] = {ToQuake({size.x, 0, 0}), ToQuake({0, size.y, 0}), ToQuake({0, 0, size.z})};
+	auto project = [&](Vector4 projection) {
+		Vector3 axis = {projection.x, projection.y, projection.z};
+		return Vector4{Vector3DotProduct(axis, quake_axes[0]), Vector3DotProduct(axis, quake_axes[1]), Vector3DotProduct(axis, quake_axes[2]),
+					   Vector3DotProduct(axis, quake_min) + projection.w};
+	};
+
+	// A texinfo is always drawn with the same texture, surfaces are shared by every vertex of the pair
+	std::unordered_map<uint32_t, uint16_t> surface_ids{};
+	packed.vertices.reserve(mesh.vertices.size());
+	for (size_t i = 0; i < mesh.vertices.size(); ++i)
+	{
+		uint32_t key = uint32_t(mesh.texinfo_ids[i]) << 16 | mesh.texture_ids[i];
+		auto [it, inserted] = surface_ids.try_emplace(key, packed.surfaces.size());
+		if (inserted)
+		{
+			if (packed.surfaces.size() > UINT16_MAX)
+				throw std::runtime_error("Too many surfaces to pack");
+			const Texture_Projection& projection = texture_projections[mesh.texinfo_ids[i]];
+			packed.surfaces.push_back({.s = project(projection.s), .t = project(projection.t), .texture_id = mesh.texture_ids[i], ._padding = {}});
+		}
+
+		Vector3 position = Vector3Divide(Vector3Subtract(mesh.vertices[i], packed.bounds.min), size);
+		Vector2 normal = OctahedralEncode(mesh.normals[i]);
+		packed.vertices.push_back({
+			.position = {QuantizeUnorm(position.x), QuantizeUnorm(position.y), QuantizeUnorm(position.z)},
+			.surface_id = it->second,
+			.lightmap_texcoord = {QuantizeUnorm(mesh.lightmap_texcoords[i].x), QuantizeUnorm(mesh.lightmap_texcoords[i].y)},
+			.normal = {(int16_t)std::lround(std::clamp(normal.x, -1.0f, 1.0f) * 32767), (int16_t)std::lround(std::clamp(normal.y, -1.0f, 1.0f) * 32767)},
+		});
+	}
+	return packed;
+}
+
+std::set<size_t>
+CollectWorldLeaves(BSP_File& map)
+{
+	// The accessors only assert, every index of the tree is checked here before it is followed
+	if (map.models.empty())
+		throw std::runtime_error("Map has no models");
+	int32_t root_id = map.model(0).bsp_node_id;
+	if (root_id < 0 || (size_t)root_id >= map.nodes.size())
+		throw std::runtime_error("Root node out of bounds");
+
+	std::vector<Node> nodes{map.node(root_id)};
 	std::set<size_t> leaves{};
+	size_t nodes_visited = 0;
 
 	while (nodes.empty() == false)
 	{
+		// A tree visits each node once, more than that means the children loop back
+		if (++nodes_visited > map.nodes.size())
+			throw std::runtime_error("Node children form a cycle");
 		Node node = nodes.back();
 		nodes.pop_back();
 
 		for (int16_t n : {node.front, node.back})
 		{
 			if (n > 0)
+			{
+				if ((size_t)n >= map.nodes.size())
+					throw std::runtime_error("Node child out of bounds");
 				nodes.push_back(map.node(n));
+			}
 			else
 			{
-				size_t leaf_id = ~n;
+				size_t leaf_id = (uint16_t)~n;
+				if (leaf_id >= map.leaves.size())
+					throw std::runtime_error("Leaf out of bounds");
+				const Leaf& leaf = map.leaf(leaf_id);
+				if ((size_t)leaf.listface_id + leaf.listface_num > map.listfaces.size())
+					throw std::runtime_error("Leaf faces out of bounds");
 				leaves.insert(leaf_id);
 			}
 		}
 	}
+	return leaves;
+}
+
+void
+BuildHulls(BSP_File& map, Map_Tree& tree)
+{
+	size_t node_count = map.nodes.size();
+	size_t hull_node_count = node_count + map.clipnodes.size();
+	auto child_of = [&](int32_t child, size_t first_node, size_t count) {
+		if (child >= 0 && (size_t)child >= count)
+			throw std::runtime_error("Hull node out of bounds");
+		return child >= 0 ? int32_t(first_node + child) : child;
+	};
+
+	tree.hull_nodes.clear();
+	tree.hull_nodes.reserve(hull_node_count);
+	for (const Node& node : map.nodes)
+	{
+		// Children of hull 0 are leaves, which only matter for their contents here
+		int32_t children[2] = {node.front, node.back};
+		for (int32_t& child : children)
+		{
+			if (child >= 0)
+				child = child_of(child, 0, node_count);
+			else if ((size_t)~child < map.leaves.size() && map.leaf(~child).type < 0)
+				child = map.leaf(~child).type;
+			else
+				throw std::runtime_error("Hull leaf out of bounds");
+		}
+		tree.hull_nodes.push_back({.plane_id = node.plane_id, .children = {children[0], children[1]}});
+	}
+	for (const Clipnode& clipnode : map.clipnodes)
+	{
+		tree.hull_nodes.push_back({
+			.plane_id = clipnode.planenum,
+			.children = {child_of(clipnode.front, node_count, map.clipnodes.size()), child_of(clipnode.back, node_count, map.clipnodes.size())},
+		});
+	}
+	for (const Hull_Node& node : tree.hull_nodes)
+	{
+		if (node.plane_id >= map.planes.size())
+			throw std::runtime_error("Hull plane out of bounds");
+	}
 
-	std::unordered_map<std::string, Texture> texture_name_to_object{};
-	std::unordered_map<std::string, std::vector<Face>> texture_name_to_face_list{}; // Group faces by texture to reduce draw calls
+	if (map.models.empty())
+		throw std::runtime_error("Map has no models");
+	const BSP_Model& world = map.model(0);
+	tree.hull_roots[0] = child_of(world.bsp_node_id, 0, node_count);
+	tree.hull_roots[1] = child_of(world.clipnode1_id, node_count, map.clipnodes.size());
+	tree.hull_roots[2] = child_of(world.clipnode2_id, node_count, map.clipnodes.size());
+}
+
+// Numbers of a key such as "origin", what the others are left at when the key is missing or has fewer of them
+static Vector3
+EntityVector(const Entity_List& entities, size_t idx, std::string_view key, Vector3 fallback)
+{
+	std::string value{entities.value(idx, key)};
+	sscanf(value.c_str(), "%f %f %f", &fallback.x, &fallback.y, &fallback.z);
+	return fallback;
+}
+
+static float
+EntityNumber(const Entity_List& entities, size_t idx, std::string_view key, float fallback)
+{
+	std::string value{entities.value(idx, key)};
+	sscanf(value.c_str(), "%f", &fallback);
+	return fallback;
+}
+
+std::vector<Model_Instance>
+FindModelInstances(BSP_File& map, const Entity_List& entities)
+{
+	std::vector<Model_Instance> instances{};
+	for (size_t i = 0; i < entities.size(); ++i)
+	{
+		std::string_view model = entities.value(i, "model");
+		if (model.starts_with("*") == false || entities.value(i, "classname").starts_with("trigger_"))
+			continue;
+
+		uint32_t model_id = 0;
+		const char* model_end = model.data() + model.size();
+		auto [end, error] = std::from_chars(model.data() + 1, model_end, model_id);
+		if (error != std::errc() || end != model_end || model_id == 0 || model_id >= map.models.size())
+		{
+			TraceLog(LOG_WARNING, "BSP: Entity %zu uses a missing model %.*s", i, (int)model.size(), model.data());
+			continue;
+		}
+
+		instances.push_back({.model_id = model_id, .origin = EntityVector(entities, i, "origin", {0, 0, 0})});
+	}
+	return instances;
+}
+
+std::vector<Map_Light>
+FindLights(const Entity_List& entities)
+{
+	// The light tool takes every class starting with "light", torches and flames included
+	std::vector<uint32_t> light_entities{};
+	for (const auto& [classname, entity_ids] : entities.classnames)
+	{
+		if (classname.starts_with("light"))
+			light_entities.insert(light_entities.end(), entity_ids.begin(), entity_ids.end());
+	}
+	std::sort(light_entities.begin(), light_entities.end()); // The index has no order between classes
+	light_entities.erase(std::unique(light_entities.begin(), light_entities.end()), light_entities.end());
+
+	std::vector<Map_Light> lights{};
+	for (uint32_t i : light_entities)
+	{
+		Map_Light light{
+			.position = EntityVector(entities, i, "origin", {0, 0, 0}),
+			.intensity = EntityNumber(entities, i, "light", 300),
+			.falloff = EntityNumber(entities, i, "wait", 1),
+			.color = EntityVector(entities, i, "_color", {1, 1, 1}),
+		};
+		if (light.intensity <= 0)
+			continue; // Negative lights only take away from the others, they are left out
+		if (light.falloff <= 0)
+			light.falloff = 1;
+		if (std::max({light.color.x, light.color.y, light.color.z}) > 1)
+			light.color = Vector3Scale(light.color, 1 / 255.f);
+		lights.push_back(light);
+	}
+	return lights;
+}
+
+Texture_Groups
+GroupFacesByTexture(BSP_File& map, const Map_Arrays& arrays, const std::set<size_t>& leaves, std::span<const Model_Instance> instances)
+{
+	Texture_Groups groups{};
+	std::vector<int32_t> miptex_group_index(arrays.miptex_groups.size(), -1); // By the miptex group, -1 until a face uses it
+	std::vector<bool> face_listed(arrays.face_count()); // Faces crossing several leaves are listed by each of them
+
+	auto texture_of = [&](uint32_t face_id) {
+		uint32_t miptex_id = arrays.face_miptex_ids[face_id];
+		if (arrays.miptex_widths[miptex_id] == 0 || arrays.miptex_heights[miptex_id] == 0)
+			throw std::runtime_error("Face uses a missing texture");
+
+		int32_t& group_index = miptex_group_index[arrays.miptex_groups[miptex_id]];
+		if (group_index < 0)
+		{
+			group_index = groups.miptex_ids.size();
+			groups.miptex_ids.push_back(miptex_id);
+		}
+		return (uint32_t)group_index;
+	};
 
 	for (size_t leaf_id : leaves)
 	{
@@ -493,39 +700,282 @@ LoadModelsFromBSPFile(const std::filesystem::path& path)
 		for (size_t i = 0; i < leaf.listface_num; i++)
 		{
 			uint16_t face_id = map.listface(leaf.listface_id + i);
-			Face face = map.face(face_id);
+			if (face_id >= arrays.face_count())
+				throw std::runtime_error("Leaf face out of bounds");
+			if (face_listed[face_id])
+				continue;
+			face_listed[face_id] = true;
+
+			// Textures are first used by the world, so its list of each texture has the same index
+			uint32_t texture_id = texture_of(face_id);
+			if (texture_id == groups.face_lists.size())
+			{
+				groups.face_lists.emplace_back();
+				groups.texture_ids.push_back(texture_id);
+			}
+			groups.face_lists[texture_id].push_back(face_id);
+		}
+	}
+	groups.model_lists = {0, (uint32_t)groups.face_lists.size()};
 
-			TexInfo texinfo = map.texinfo(face.texinfo_id);
-			Miptex miptex = map.miptex(texinfo.miptex_id);
+	std::vector<bool> model_drawn(map.models.size());
+	for (const Model_Instance& instance : instances)
+		model_drawn[instance.model_id] = true;
 
-			std::string texname = miptex.name;
-			texture_name_to_face_list[texname].push_back(face);
+	for (size_t model_id = 1; model_id < map.models.size(); ++model_id)
+	{
+		const BSP_Model& model = map.model(model_id);
+		if (model_drawn[model_id])
+		{
+			if (model.face_id < 0 || model.face_num < 0 || (size_t)model.face_id + model.face_num > arrays.face_count())
+				throw std::runtime_error("Model faces out of bounds");
 
-			if (texture_name_to_object.contains(texname) == false)
+			// Models use a handful of textures, a linear search of their own lists is enough
+			size_t first_list = groups.face_lists.size();
+			for (uint32_t face_id = model.face_id; face_id < (uint32_t)(model.face_id + model.face_num); ++face_id)
 			{
-				std::vector<Color_RGB8> color_data = map.miptex_data(texinfo.miptex_id, 0);
-				Image texture_image = {
-					.data = color_data.data(),
-					.width = (int)miptex.width,
-					.height = (int)miptex.height,
-					.mipmaps = 1,
-					.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8,
-				};
-
-				texture_name_to_object[texname] = LoadTextureFromImage(texture_image);
+				uint32_t texture_id = texture_of(face_id);
+				size_t list = first_list;
+				while (list < groups.face_lists.size() && groups.texture_ids[list] != texture_id)
+					++list;
+				if (list == groups.face_lists.size())
+				{
+					groups.face_lists.emplace_back();
+					groups.texture_ids.push_back(texture_id);
+				}
+				groups.face_lists[list].push_back(face_id);
 			}
 		}
+		groups.model_lists.push_back(groups.face_lists.size());
 	}
+	return groups;
+}
+
+void
+DecodePaletteScalar(std::span<const uint8_t> indices, Color_RGB8* out)
+{
+	for (size_t i = 0; i < indices.size(); ++i)
+		out[i] = palette(indices[i]);
+}
+
+bool
+HasPaletteAVX2()
+{
+#if !PALETTE_AVX2
+	return false;
+#elif defined(_MSC_VER)
+	// The OS must also save the YMM registers on context switches
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
 
-	std::vector<Model> models{};
-	for (auto& [texname, faces] : texture_name_to_face_list)
+#if PALETTE_AVX2
+TARGET_AVX2 void
+DecodePaletteAVX2(std::span<const uint8_t> indices, Color_RGB8* out)
+{
+	// Colors padded to 4 bytes so 8 of them are fetched by one gather
+	static const std::vector<uint32_t> rgbx = [] {
+		std::vector<uint32_t> table(256);
+		for (int id = 0; id < 256; ++id)
+		{
+			Color_RGB8 color = palette(id);
+			table[id] = color.r | color.g << 8 | color.b << 16;
+		}
+		return table;
+	}();
+
+	// Drops the padding, leaving 12 bytes of colors at the start of each 128 bit lane
+	const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+										  0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+	// Each lane is stored as 16 bytes, the 4 past its colors are overwritten by the next store.
+	// The last pixels go through the scalar path so nothing is written past the end of out.
+	uint8_t* dst = (uint8_t*)out;
+	size_t i = 0;
+	for (; i + 10 <= indices.size(); i += 8)
 	{
-		Mesh mesh = GenMeshFaces(map, faces);
-		Model model = LoadModelFromMesh(mesh);
-		model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture = texture_name_to_object.at(texname);
-		models.push_back(model);
+		__m256i ids = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices.data() + i)));
+		__m256i colors = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)rgbx.data(), ids, 4), pack);
+		_mm_storeu_si128((__m128i*)(dst + 3 * i), _mm256_castsi256_si128(colors));
+		_mm_storeu_si128((__m128i*)(dst + 3 * i + 12), _mm256_extracti128_si256(colors, 1));
 	}
-	return models;
+	DecodePaletteScalar(indices.subspan(i), out + i);
+}
+#else
+void
+DecodePaletteAVX2(std::span<const uint8_t> indices, Color_RGB8* out)
+{
+	DecodePaletteScalar(indices, out);
+}
+#endif
+
+void
+DecodePalette(std::span<const uint8_t> indices, Color_RGB8* out)
+{
+	static const bool avx2 = HasPaletteAVX2();
+	if (avx2)
+		DecodePaletteAVX2(indices, out);
+	else
+		DecodePaletteScalar(indices, out);
+}
+
+Texture_Data
+DecodeTexture(BSP_File& map, uint32_t miptex_id)
+{
+	Miptex miptex = map.miptex(miptex_id);
+	Texture_Data texture = {
+		.name = std::string(miptex.name, strnlen(miptex.name, sizeof(miptex.name))), // Not terminated when it fills all 16 bytes
+		.width = (int)miptex.width,
+		.height = (int)miptex.height,
+		.mipmaps = 0,
+	};
+
+	// Below 8 texels across, the last levels the BSP stores have no pixels at all and are left out
+	while (texture.mipmaps < MIPLEVELS && (miptex.width >> texture.mipmaps) > 0 && (miptex.height >> texture.mipmaps) > 0)
+		++texture.mipmaps;
+
+	size_t pixel_count = 0;
+	for (uint8_t miplevel = 0; miplevel < texture.mipmaps; ++miplevel)
+		pixel_count += map.miptex_pixels(miptex_id, miplevel).size();
+	texture.pixels.resize(pixel_count);
+	texture.indices.reserve(pixel_count);
+
+	Color_RGB8* out = texture.pixels.data();
+	for (uint8_t miplevel = 0; miplevel < texture.mipmaps; ++miplevel)
+	{
+		std::span<const uint8_t> indices = map.miptex_pixels(miptex_id, miplevel);
+		DecodePalette(indices, out);
+		out += indices.size();
+		texture.indices.insert(texture.indices.end(), indices.begin(), indices.end());
+	}
+	return texture;
+}
+
+std::optional<Map_Data>
+LoadMapDataFromBSPFile(const std::filesystem::path& path, std::stop_token stop, std::atomic<float>* progress)
+{
+	BSP_File map{path};
+	return LoadMapDataFromBSPFile(map, stop, progress);
+}
+
+std::optional<Map_Data>
+LoadMapDataFromBSPFile(BSP_File& map, std::stop_token stop, std::atomic<float>* progress)
+{
+	Map_Arrays arrays = DecodeMapArrays(map);
+
+	std::set<size_t> leaves = CollectWorldLeaves(map);
+	Entity_List entities = map.entities();
+	std::vector<Model_Instance> instances = FindModelInstances(map, entities);
+	Texture_Groups groups = GroupFacesByTexture(map, arrays, leaves, instances);
+	const std::vector<std::vector<uint32_t>>& texture_face_lists = groups.face_lists;
+
+	if (stop.stop_requested())
+		return std::nullopt;
+
+	// Vertices need to know where their lightmap is, so the atlas is packed before any mesh is built
+	Map_Data data{};
+	std::vector<uint32_t> drawn_faces{};
+	for (const std::vector<uint32_t>& face_list : texture_face_lists)
+		drawn_faces.insert(drawn_faces.end(), face_list.begin(), face_list.end());
+	std::vector<Face_Lightmap> face_lightmaps{};
+	data.lightmap = PackLightmaps(arrays, map.lightmaps, drawn_faces, face_lightmaps);
+
+	// Face lists are independent, each one is triangulated on the pool along with the texture it introduces
+	std::atomic<size_t> groups_done = 0;
+	data.textures.resize(groups.miptex_ids.size());
+	std::vector<Mesh_Data> meshes(texture_face_lists.size());
+	std::vector<std::vector<Draw_Range>> mesh_face_ranges(texture_face_lists.size());
+
+	DefaultThreadPool().parallel_for(texture_face_lists.size(), [&](size_t i) {
+		if (stop.stop_requested())
+			return;
+
+		if (i < groups.miptex_ids.size())
+			data.textures[i] = DecodeTexture(map, groups.miptex_ids[i]);
+		meshes[i] = GenMeshFaces(arrays, texture_face_lists[i], groups.texture_ids[i], face_lightmaps, data.lightmap, mesh_face_ranges[i]);
+
+		if (progress)
+			*progress = float(++groups_done) / texture_face_lists.size();
+	});
+
+	if (stop.stop_requested())
+		return std::nullopt;
+
+	// Concatenate the lists into one buffer, sorted by model then texture, each list becomes a draw range
+	Map_Tree& tree = data.tree;
+	tree.face_ranges.resize(map.faces.size());
+	for (size_t i = 0; i < meshes.size(); ++i)
+	{
+		uint32_t first_index = data.mesh.indices.size();
+		data.ranges.push_back({
+			.texture_id = groups.texture_ids[i],
+			.first_index = first_index,
+			.index_count = (uint32_t)meshes[i].indices.size(),
+		});
+		AppendMeshData(data.mesh, meshes[i]);
+
+		for (size_t j = 0; j < texture_face_lists[i].size(); ++j)
+		{
+			Draw_Range range = mesh_face_ranges[i][j];
+			range.first_index += first_index;
+			tree.face_ranges[texture_face_lists[i][j]] = range;
+		}
+	}
+
+	for (size_t i = 0; i < map.models.size(); ++i)
+	{
+		const BSP_Model& model = map.model(i);
+		data.models.push_back({
+			.bounds = model.bound,
+			.origin = model.origin,
+			.first_range = groups.model_lists[i],
+			.range_count = groups.model_lists[i + 1] - groups.model_lists[i],
+		});
+	}
+	data.model_instances = std::move(instances);
+	data.lights = FindLights(entities);
+	data.texture_projections = TextureProjections(arrays);
+	data.packed_mesh = PackMesh(data.mesh, data.texture_projections);
+
+	tree.root_node = map.model(0).bsp_node_id;
+	tree.visleaf_count = map.model(0).numleafs;
+	tree.planes.assign(map.planes.begin(), map.planes.end());
+	tree.nodes.assign(map.nodes.begin(), map.nodes.end());
+	tree.leaves.assign(map.leaves.begin(), map.leaves.end());
+	tree.listfaces.assign(map.listfaces.begin(), map.listfaces.end());
+	tree.visibility.assign(map.visibility.begin(), map.visibility.end());
+	BuildHulls(map, tree);
+
+	for (const Node& node : tree.nodes)
+	{
+		if ((size_t)node.face_id + node.face_num > arrays.face_count())
+			throw std::runtime_error("Node faces out of bounds");
+	}
+	tree.face_first_vertices.reserve(arrays.face_count() + 1);
+	for (size_t face_id = 0; face_id < arrays.face_count(); ++face_id)
+	{
+		tree.face_first_vertices.push_back(tree.face_vertices.size());
+		for (uint16_t vertex_id : arrays.face_vertices_of(face_id))
+			tree.face_vertices.push_back(arrays.vertices[vertex_id]);
+	}
+	tree.face_first_vertices.push_back(tree.face_vertices.size());
+	tree.face_texinfo_ids = arrays.face_texinfo_ids;
+	tree.face_sides = arrays.face_sides;
+
+	const Mesh_Data& mesh = data.mesh;
+	TraceLog(LOG_INFO, "BSP: %zu vertices after welding, down from %zu (%.1f%%)", mesh.vertices.size(), mesh.soup_vertex_count, 100.f * mesh.vertices.size() / std::max<size_t>(mesh.soup_vertex_count, 1));
+	TraceLog(LOG_INFO, "BSP: Lightmaps packed in a %ix%i atlas", data.lightmap.width, data.lightmap.height);
+	return data;
 }
 
 Color_RGB8
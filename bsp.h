@@ -0,0 +1,397 @@
+#pragma once
+
+#include <raylib.h>
+
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+struct Color_RGB8
+{
+	uint8_t r, g, b;
+};
+static_assert(sizeof(Color_RGB8) == 3);
+
+#pragma pack(push, 1)
+
+struct Vector3S
+{
+	int16_t x, y, z;
+};
+
+struct BoundingBoxS // Bounding Box, Short values
+{
+	Vector3S min, max;
+};
+
+struct Dir_Entry // A Directory entry
+{
+	int32_t offset; // Offset to entry, in bytes, from start of file
+	int32_t size;   // Size of entry in file, in bytes
+};
+
+struct Header // The BSP file header
+{
+	int32_t version; // Model version, must be 0x17 (23).
+
+	Dir_Entry entities;   // List of Entities.
+	Dir_Entry planes;     // Map Planes.
+						  // numplanes = size/sizeof(plane_t)
+	Dir_Entry miptex;     // Wall Textures.
+	Dir_Entry vertices;   // Map Vertices.
+						  // numvertices = size/sizeof(vertex_t)
+	Dir_Entry visibility; // Leaves Visibility lists.
+	Dir_Entry nodes;      // BSP Nodes.
+						  // numnodes = size/sizeof(node_t)
+	Dir_Entry texinfos;   // Texture Info for faces.
+						  // numtexinfo = size/sizeof(texinfo_t)
+	Dir_Entry faces;      // Faces of each surface.
+						  // numfaces = size/sizeof(face_t)
+	Dir_Entry lightmaps;  // Wall Light Maps.
+	Dir_Entry clipnodes;  // clip nodes, for Models.
+						  // numclips = size/sizeof(clipnode_t)
+	Dir_Entry leaves;     // BSP Leaves.
+						  // numleaves = size/sizeof(leaf_t)
+	Dir_Entry listfaces;  // List of Faces.
+	Dir_Entry edges;      // Edges of faces.
+						  // numedges = size/sizeof(edge_t)
+	Dir_Entry listedges;  // List of Edges.
+	Dir_Entry models;     // List of Models.
+						  // nummodels = Size/sizeof(model_t)
+};
+
+struct Entity_Field
+{
+	std::string_view key, value;
+};
+
+struct Entity_List // Views into the entity lump text, which must outlive them
+{
+	std::vector<Entity_Field> fields;          // Fields of every entity, one entity after the other
+	std::vector<uint32_t> entity_fields = {0}; // Where each entity starts in fields, then where the last one ends
+	std::unordered_map<std::string_view, std::vector<uint32_t>> classnames; // Entities of each class
+
+	size_t
+	size() const
+	{
+		return entity_fields.size() - 1;
+	}
+
+	std::span<const Entity_Field>
+	operator[](size_t idx) const
+	{
+		return std::span{fields}.subspan(entity_fields[idx], entity_fields[idx + 1] - entity_fields[idx]);
+	}
+
+	// Empty when the entity has no such key
+	std::string_view
+	value(size_t idx, std::string_view key) const
+	{
+		for (const Entity_Field& field : (*this)[idx])
+			if (field.key == key)
+				return field.value;
+		return {};
+	}
+
+	std::span<const uint32_t>
+	with_classname(std::string_view classname) const
+	{
+		auto it = classnames.find(classname);
+		if (it == classnames.end())
+			return {};
+		return it->second;
+	}
+};
+
+struct BSP_Model
+{
+	BoundingBox bound;    // The bounding box of the Model
+	Vector3 origin;       // origin of model, usually (0,0,0)
+	int32_t bsp_node_id;  // index of first BSP node
+	int32_t clipnode1_id; // index of the first Clip node
+	int32_t clipnode2_id; // index of the second Clip node
+	int32_t _dummy_id;    // usually zero
+	int32_t numleafs;     // number of BSP leaves
+	int32_t face_id;      // index of Faces
+	int32_t face_num;     // number of Faces
+};
+
+struct Edge
+{
+	uint16_t vs; // index of the start vertex
+		//  must be in [0,numvertices[
+	uint16_t ve; // index of the end vertex
+				 //  must be in [0,numvertices[
+};
+
+struct Plane
+{
+	Vector3 normal; // Vector orthogonal to plane (Nx,Ny,Nz)
+	float dist;     // Offset to plane, along the normal vector.
+	int32_t type;   // Type of plane, depending on normal vector.
+};
+
+struct TexInfo
+{
+	Vector3 u_axis;     // U vector, horizontal in texture space)
+	float u_offset;     // horizontal offset in texture space
+	Vector3 v_axis;     // V vector, vertical in texture space
+	float v_offset;     // vertical offset in texture space
+	uint32_t miptex_id; // Index of Mip Texture
+						//           must be in [0,numtex[
+	uint32_t animated;  // 0 for ordinary textures, 1 for water
+};
+
+struct Face
+{
+	uint16_t plane_id;   // The plane in which the face lies
+						 //           must be in [0,numplanes[
+	uint16_t side;       // 0 if in front of the plane, 1 if behind the plane
+	int32_t ledge_id;    // first edge in the List of edges
+						 //           must be in [0,numledges[
+	uint16_t ledge_num;  // number of edges in the List of edges
+	uint16_t texinfo_id; // index of the Texture info the face is part of
+						 //           must be in [0,numtexinfos[
+	uint8_t typelight;   // type of lighting, for the face
+	uint8_t baselight;   // from 0xFF (dark) to 0 (bright)
+	uint8_t light[2];    // two additional light models
+	int32_t lightmap;    // Pointer inside the general light map, or -1
+						 // this define the start of the face light map
+};
+
+constexpr uint8_t MIPLEVELS = 4;
+
+struct Miptex // Mip Texture
+{
+	char name[16];              // Name of the texture.
+	uint32_t width;             // width of picture, must be a multiple of 8
+	uint32_t height;            // height of picture, must be a multiple of 8
+	uint32_t offset[MIPLEVELS]; // offsets to uint8_t Pix[width * height], relative to start of Miptex
+};
+
+/**
+* typedef struct                 // Mip texture list header
+* { int32_t numtex;                 // Number of textures in Mip Texture list
+*   int32_t offset[numtex];         // Offset to each of the individual texture from the beginning of mipheader_t
+* } mipheader_t;
+*/
+
+struct Node
+{
+	uint32_t plane_id; // The plane that splits the node
+					   //           must be in [0,numplanes[
+	int16_t front;     // If > 0,  front = index of Front child node
+					   // else,   ~front = index of child leaf
+	int16_t back;      // If > 0,   back = index of Back child node
+					   // else,    ~back = index of child leaf
+	BoundingBoxS box;  // Bounding box of node and all childs
+	uint16_t face_id;  // Index of first Polygons in the node
+	uint16_t face_num; // Number of faces in the node
+};
+
+// Leaf types, also what clipnode children below 0 stand for
+constexpr int32_t CONTENTS_EMPTY = -1;
+constexpr int32_t CONTENTS_SOLID = -2;
+constexpr int32_t CONTENTS_WATER = -3;
+constexpr int32_t CONTENTS_SLIME = -4;
+constexpr int32_t CONTENTS_LAVA = -5;
+constexpr int32_t CONTENTS_SKY = -6;
+
+struct Leaf
+{
+	int32_t type;          // Special type of leaf, one of the CONTENTS values
+	int32_t visibility_id; // Beginning of visibility lists
+						   //     must be -1 or in [0,numvislist[
+	BoundingBoxS bound;    // Bounding box of the leaf
+	uint16_t listface_id;  // First item of the list of faces
+						   //     must be in [0,numlfaces[
+	uint16_t listface_num; // Number of faces in the leaf
+	uint8_t sndwater;      // level of the four ambient sounds:
+	uint8_t sndsky;        //   0    is no sound
+	uint8_t sndslime;      //   0xFF is maximum volume
+	uint8_t sndlava;       //
+};
+
+// uint16_t listface[numlface];   // each uint16_t is the index of a Face
+
+// int32_t listedge[numlstedge];
+
+// uint8_t vislist[numvislist];    // RLE encoded bit array
+
+struct Clipnode
+{
+	uint32_t planenum; // The plane which splits the node
+	int16_t front;     // If positive, id of Front child node
+					   // If -2, the Front part is inside the model
+					   // If -1, the Front part is outside the model
+	int16_t back;      // If positive, id of Back child node
+					   // If -2, the Back part is inside the model
+					   // If -1, the Back part is outside the model
+};
+
+// uint8_t lightmap[numlightmap]; // value 0:dark 255:bright
+
+// uint8_t light[width*height];
+#pragma pack(pop)
+
+struct Mesh_Data // Indexed triangle list built on the CPU, ready to be uploaded
+{
+	std::vector<Vector3> vertices;
+	std::vector<Vector2> texcoords;
+	std::vector<Vector2> lightmap_texcoords; // Into Map_Data::lightmap
+	std::vector<Vector3> normals;
+	std::vector<uint16_t> texture_ids; // Index into Map_Data::textures
+	std::vector<uint16_t> texinfo_ids; // Into Map_Data::texture_projections
+	std::vector<uint32_t> indices;
+	size_t soup_vertex_count = 0; // Vertices the same triangles take without indexing
+};
+
+struct Texture_Projection // Texture coordinates of a texinfo from Quake coordinates, divided by the texture size
+{
+	Vector4 s, t; // dot(xyz, position) + w
+};
+
+struct Texture_Data
+{
+	std::string name;
+	int width, height;
+	int mipmaps;                    // Levels stored, each at least one pixel across
+	std::vector<Color_RGB8> pixels; // Every mip level, one after the other
+	std::vector<uint8_t> indices;   // The same pixels as palette indices
+};
+
+struct Lightmap_Data // Static lighting of every face packed in one atlas, 128 is the texture at full brightness
+{
+	int width, height;
+	std::vector<uint8_t> pixels;
+};
+
+struct Draw_Range // Consecutive indices drawn with the same texture
+{
+	uint32_t texture_id;
+	uint32_t first_index;
+	uint32_t index_count;
+};
+
+struct Hull_Node // A clipnode with room for the children of every hull in one array
+{
+	uint32_t plane_id;
+	int32_t children[2]; // Front then back, another node of the hull when >= 0, otherwise the CONTENTS on that side
+};
+
+struct Map_Tree // BSP tree of the world model, kept to find what is visible from a point
+{
+	int32_t root_node;
+	int32_t visleaf_count; // Leaves covered by the visibility lists, not counting leaf 0
+	std::vector<Plane> planes;
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+	std::vector<uint16_t> listfaces;
+	std::vector<uint8_t> visibility;
+	std::vector<Draw_Range> face_ranges; // Per BSP face, index_count is 0 for faces that are not drawn
+
+	// Outline of every face, to find the one a ray hits among those lying on a node
+	std::vector<uint32_t> face_first_vertices; // Into face_vertices, then where the last face ends
+	std::vector<Vector3> face_vertices;        // Quake coordinates
+	std::vector<uint16_t> face_texinfo_ids;
+	std::vector<uint8_t> face_sides;           // 1 when the face looks away from the normal of its node
+
+	// Collision hulls of the world: points, then the player and larger monsters, both grown by their size
+	std::vector<Hull_Node> hull_nodes; // Hull 0 is made from the nodes, the clipnodes of the others follow them
+	int32_t hull_roots[3];
+};
+
+struct Map_Model // A brush model, the world is model 0 and doors, lifts and the like follow it
+{
+	BoundingBox bounds; // Quake coordinates
+	Vector3 origin;
+	uint32_t first_range, range_count; // Into Map_Data::ranges, none when the model is never drawn
+};
+
+struct Model_Instance // An entity placing a brush model, its "model" key is "*" followed by the model id
+{
+	uint32_t model_id;
+	Vector3 origin; // Quake coordinates, how far the model is moved from where it was built
+};
+
+struct Map_Light // A light entity, lighting falls off linearly as in the light tool
+{
+	Vector3 position; // Quake coordinates
+	float intensity;  // The "light" key, also how far it reaches when falloff is 1
+	float falloff;    // The "wait" key, scales distances
+	Vector3 color;    // The "_color" key some tools add, white otherwise
+};
+
+#pragma pack(push, 1)
+
+struct Packed_Vertex // The mesh as the GPU draws it, lighting.vert unpacks it
+{
+	uint16_t position[3];          // Between the bounds of the mesh, 0 at the minimum and 65535 at the maximum
+	uint16_t surface_id;           // Into Packed_Mesh::surfaces
+	uint16_t lightmap_texcoord[2]; // 0 to 65535 across the atlas
+	int16_t normal[2];             // Octahedral, -32767 to 32767
+};
+static_assert(sizeof(Packed_Vertex) == 16);
+
+#pragma pack(pop)
+
+struct Packed_Surface // A texinfo drawn with a texture, laid out as Surface in lighting.vert
+{
+	Vector4 s, t;          // Texture coordinates from the packed position, going from 0 to 1 between the bounds
+	uint32_t texture_id;   // Into Map_Data::textures
+	uint32_t _padding[3];
+};
+static_assert(sizeof(Packed_Surface) == 48);
+
+struct Packed_Mesh
+{
+	BoundingBox bounds; // Viewer coordinates
+	std::vector<Packed_Vertex> vertices;
+	std::vector<Packed_Surface> surfaces;
+};
+
+struct Map_Data // Everything needed to display a map, without touching the GPU
+{
+	std::vector<Texture_Data> textures;
+	Mesh_Data mesh; // Every model one after the other, the indices of each one sorted by texture
+	std::vector<Texture_Projection> texture_projections; // Per texinfo
+	Packed_Mesh packed_mesh; // The mesh as it is uploaded, packed while loading
+	std::vector<Draw_Range> ranges;
+	Lightmap_Data lightmap;
+	Map_Tree tree;
+	std::vector<Map_Model> models;
+	std::vector<Model_Instance> model_instances;
+	std::vector<Map_Light> lights;
+};
+
+// Quantizes the vertices of the mesh, its texture coordinates are left for the shader to project from the positions
+Packed_Mesh
+PackMesh(const Mesh_Data& mesh, std::span<const Texture_Projection> texture_projections);
+
+// Single pass over the text of an entity lump, keys and values point into it
+Entity_List
+ParseEntities(std::string_view text);
+
+// Color of an index in the Quake palette, which every texture uses
+Color_RGB8
+palette(uint8_t id);
+
+// Quake is Z-up and much larger than what the viewer works with
+Vector3
+FromQuake(Vector3 quakeVec);
+
+Vector3
+ToQuake(Vector3 vec);
+
+// Safe to call from any thread, returns nothing if stop was requested before it finished.
+// progress goes from 0 to 1 as the map is processed.
+std::optional<Map_Data>
+LoadMapDataFromBSPFile(const std::filesystem::path& path, std::stop_token stop = {}, std::atomic<float>* progress = nullptr);
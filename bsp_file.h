@@ -0,0 +1,338 @@
+#pragma once
+
+// The stages LoadMapDataFromBSPFile is made of, for tools that need to run them one at a time
+
+#include <raylib.h>
+
+#include "bsp.h"
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <set>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <string.h>
+
+// Colors of every index written to out, which must have room for all of them. Uses AVX2 when the CPU has it.
+void
+DecodePalette(std::span<const uint8_t> indices, Color_RGB8* out);
+
+// The kernels DecodePalette picks from, DecodePaletteAVX2 must only be called when HasPaletteAVX2 is true
+void
+DecodePaletteScalar(std::span<const uint8_t> indices, Color_RGB8* out);
+
+void
+DecodePaletteAVX2(std::span<const uint8_t> indices, Color_RGB8* out);
+
+bool
+HasPaletteAVX2();
+
+struct BSP_File
+{
+	Mapped_File file;
+	Header header;
+
+	std::span<const Plane> planes;
+	std::span<const Vector3> vertices;
+	std::span<const Node> nodes;
+	std::span<const TexInfo> texinfos;
+	std::span<const Face> faces;
+	std::span<const Clipnode> clipnodes;
+	std::span<const Leaf> leaves;
+	std::span<const uint16_t> listfaces;
+	std::span<const Edge> edges;
+	std::span<const int32_t> listedges;
+	std::span<const BSP_Model> models;
+	std::span<const uint8_t> visibility;
+	std::span<const uint8_t> lightmaps;
+	std::span<const char> entity_lump;
+	std::span<const uint8_t> miptex_lump;
+	std::span<const int32_t> miptex_offsets; // Relative to the start of miptex_lump, -1 if the texture is missing
+
+	// copy reads the file into memory rather than mapping it, see Mapped_File
+	BSP_File(const std::filesystem::path& path, bool copy = false) : file(path, copy)
+	{
+		if (file.bytes.size() < sizeof(Header))
+			throw std::runtime_error("File too small to be a BSP");
+		memcpy(&header, file.bytes.data(), sizeof(Header));
+
+		planes = _lump<Plane>(header.planes);
+		vertices = _lump<Vector3>(header.vertices);
+		nodes = _lump<Node>(header.nodes);
+		texinfos = _lump<TexInfo>(header.texinfos);
+		faces = _lump<Face>(header.faces);
+		clipnodes = _lump<Clipnode>(header.clipnodes);
+		leaves = _lump<Leaf>(header.leaves);
+		listfaces = _lump<uint16_t>(header.listfaces);
+		edges = _lump<Edge>(header.edges);
+		listedges = _lump<int32_t>(header.listedges);
+		models = _lump<BSP_Model>(header.models);
+		visibility = _lump<uint8_t>(header.visibility);
+		lightmaps = _lump<uint8_t>(header.lightmaps);
+		entity_lump = _lump<char>(header.entities);
+
+		miptex_lump = _lump<uint8_t>(header.miptex);
+		if (miptex_lump.empty() == false)
+		{
+			std::span<const int32_t> miptex_header = _lump<int32_t>({header.miptex.offset, (int32_t)sizeof(int32_t)});
+			int32_t count = miptex_header[0];
+			if (count < 0 || (size_t)count > (miptex_lump.size() - sizeof(int32_t)) / sizeof(int32_t))
+				throw std::runtime_error("Invalid miptex count");
+
+			miptex_offsets = _lump<int32_t>({header.miptex.offset + (int32_t)sizeof(int32_t), count * (int32_t)sizeof(int32_t)});
+			for (int32_t offset : miptex_offsets)
+			{
+				if (offset == -1)
+					continue;
+				if (offset < 0 || (size_t)offset + sizeof(Miptex) > miptex_lump.size())
+					throw std::runtime_error("Miptex out of bounds");
+
+				Miptex mptx = _miptex_at(offset);
+				for (uint8_t miplevel = 0; miplevel < MIPLEVELS; ++miplevel)
+				{
+					size_t pixels = (size_t)(mptx.width >> miplevel) * (mptx.height >> miplevel);
+					if ((size_t)offset + mptx.offset[miplevel] + pixels > miptex_lump.size())
+						throw std::runtime_error("Miptex data out of bounds");
+				}
+			}
+		}
+	}
+
+	template<typename T>
+	std::span<const T>
+	_lump(Dir_Entry dir)
+	{
+		if (dir.offset < 0 || dir.size < 0 || (size_t)dir.offset + dir.size > file.bytes.size())
+			throw std::runtime_error("Lump out of bounds");
+		if (dir.size % sizeof(T) != 0 || dir.offset % alignof(T) != 0)
+			throw std::runtime_error("Misaligned lump");
+
+		return {(const T*)(file.bytes.data() + dir.offset), dir.size / sizeof(T)};
+	}
+
+	Miptex
+	_miptex_at(int32_t offset)
+	{
+		Miptex mptx{};
+		memcpy(&mptx, miptex_lump.data() + offset, sizeof(Miptex));
+		return mptx;
+	}
+
+	// Valid as long as the file stays open
+	Entity_List
+	entities()
+	{
+		return ParseEntities({entity_lump.data(), strnlen(entity_lump.data(), entity_lump.size())});
+	}
+
+	const Plane&
+	plane(size_t idx)
+	{
+		assert(idx < planes.size());
+		return planes[idx];
+	}
+
+	int32_t
+	miptex_count()
+	{
+		return miptex_offsets.size();
+	}
+
+	Miptex
+	miptex(size_t idx)
+	{
+		assert(idx < miptex_offsets.size() && miptex_offsets[idx] != -1);
+		return _miptex_at(miptex_offsets[idx]);
+	}
+
+	const Vector3&
+	vertex(size_t idx)
+	{
+		assert(idx < vertices.size());
+		return vertices[idx];
+	}
+
+	const Node&
+	node(size_t idx)
+	{
+		assert(idx < nodes.size());
+		return nodes[idx];
+	}
+
+	const TexInfo&
+	texinfo(size_t idx)
+	{
+		assert(idx < texinfos.size());
+		return texinfos[idx];
+	}
+
+	const Face&
+	face(size_t idx)
+	{
+		assert(idx < faces.size());
+		return faces[idx];
+	}
+
+	const Leaf&
+	leaf(size_t idx)
+	{
+		assert(idx < leaves.size());
+		return leaves[idx];
+	}
+
+	uint16_t
+	listface(size_t idx)
+	{
+		assert(idx < listfaces.size());
+		return listfaces[idx];
+	}
+
+	const Edge&
+	edge(size_t idx)
+	{
+		assert(idx < edges.size());
+		return edges[idx];
+	}
+
+	int32_t
+	listedge(size_t idx)
+	{
+		assert(idx < listedges.size());
+		return listedges[idx];
+	}
+
+	const BSP_Model&
+	model(size_t idx)
+	{
+		assert(idx < models.size());
+		return models[idx];
+	}
+
+	std::span<const uint8_t>
+	miptex_pixels(size_t idx, uint8_t miplevel)
+	{
+		Miptex mptx = miptex(idx);
+
+		uint32_t width = mptx.width >> miplevel;
+		uint32_t height = mptx.height >> miplevel;
+		return miptex_lump.subspan(miptex_offsets[idx] + mptx.offset[miplevel], width * height);
+	}
+
+	std::vector<Color_RGB8>
+	miptex_data(size_t idx, uint8_t miplevel)
+	{
+		std::span<const uint8_t> palette_indices = miptex_pixels(idx, miplevel);
+
+		std::vector<Color_RGB8> color_data(palette_indices.size());
+		DecodePalette(palette_indices, color_data.data());
+		return color_data;
+	}
+};
+
+// The lumps the loader stages read per face, decoded once into flat arrays with every index checked and
+// followed, so the stages go through them in order instead of looking up texinfos, edges and miptex headers
+struct Map_Arrays
+{
+	std::vector<Vector3> vertices;
+
+	// Per texinfo
+	std::vector<Vector3> texinfo_u_axes, texinfo_v_axes;
+	std::vector<float> texinfo_u_offsets, texinfo_v_offsets;
+	std::vector<uint32_t> texinfo_flags;
+	std::vector<uint32_t> texinfo_miptex_ids;
+
+	// Per miptex, missing textures are 0x0
+	std::vector<uint32_t> miptex_widths, miptex_heights;
+	std::vector<uint32_t> miptex_groups; // Lowest miptex id with the same name, faces are grouped on it
+
+	// Per face
+	std::vector<uint32_t> face_first_vertices; // Into face_vertices
+	std::vector<uint16_t> face_vertex_counts;
+	std::vector<uint16_t> face_texinfo_ids;
+	std::vector<uint32_t> face_miptex_ids;
+	std::vector<uint16_t> face_plane_ids;
+	std::vector<uint8_t> face_sides;
+	std::vector<Vector3> face_normals; // Viewer coordinates
+	std::vector<int32_t> face_lightmaps;
+
+	std::vector<uint16_t> face_vertices; // Vertex ids around every face, one face after the other
+
+	size_t
+	face_count() const
+	{
+		return face_texinfo_ids.size();
+	}
+
+	std::span<const uint16_t>
+	face_vertices_of(size_t face_id) const
+	{
+		return std::span{face_vertices}.subspan(face_first_vertices[face_id], face_vertex_counts[face_id]);
+	}
+};
+
+Map_Arrays
+DecodeMapArrays(BSP_File& map);
+
+// How every texinfo maps positions to texture coordinates, as GenMeshFaces computes them
+std::vector<Texture_Projection>
+TextureProjections(const Map_Arrays& arrays);
+
+// Leaves reachable from the root of the world model
+std::set<size_t>
+CollectWorldLeaves(BSP_File& map);
+
+// Collision hulls of the world model in one array, hull 0 made from the BSP nodes
+void
+BuildHulls(BSP_File& map, Map_Tree& tree);
+
+// Entities showing a brush model, leaving out triggers since the game never draws them
+std::vector<Model_Instance>
+FindModelInstances(BSP_File& map, const Entity_List& entities);
+
+// Light entities, which the lightmaps were baked from, in the order of the entity lump
+std::vector<Map_Light>
+FindLights(const Entity_List& entities);
+
+struct Texture_Groups // Faces of each model grouped by texture name, to reduce draw calls
+{
+	std::vector<uint32_t> miptex_ids;              // One per texture, in the order faces first use them
+	std::vector<std::vector<uint32_t>> face_lists; // One per model and texture, the lists of the world come first
+	std::vector<uint32_t> texture_ids;             // Of each face list, the world has list i for texture i
+	std::vector<uint32_t> model_lists;             // Where the lists of each model start, then where the last one ends
+};
+
+// Faces of the world in the given leaves, then faces of every model with an instance
+Texture_Groups
+GroupFacesByTexture(BSP_File& map, const Map_Arrays& arrays, const std::set<size_t>& leaves, std::span<const Model_Instance> instances);
+
+// Every mip level stored in the file, through the palette
+Texture_Data
+DecodeTexture(BSP_File& map, uint32_t miptex_id);
+
+struct Face_Lightmap // Where the lightmap of a face landed in the atlas
+{
+	int32_t offset;      // Into the lightmaps lump, -1 when the face uses one of the constant luxels
+	int texture_mins[2]; // Texture space position of the first luxel, in luxels
+	int width, height;
+	int x, y;
+};
+
+// Packs the first lightmap of every face into one atlas, face_lightmaps is indexed by face id
+Lightmap_Data
+PackLightmaps(const Map_Arrays& arrays, std::span<const uint8_t> lightmap_lump, std::span<const uint32_t> face_ids, std::vector<Face_Lightmap>& face_lightmaps);
+
+// Welded, indexed triangles for the given faces, with one draw range per face
+Mesh_Data
+GenMeshFaces(const Map_Arrays& arrays, std::span<const uint32_t> face_ids, uint16_t texture_id, std::span<const Face_Lightmap> face_lightmaps,
+			 const Lightmap_Data& atlas, std::vector<Draw_Range>& face_ranges);
+
+void
+AppendMeshData(Mesh_Data& mesh, const Mesh_Data& other);
+
+// LoadMapDataFromBSPFile on a file already open, for callers that also look at its bytes
+std::optional<Map_Data>
+LoadMapDataFromBSPFile(BSP_File& map, std::stop_token stop = {}, std::atomic<float>* progress = nullptr);
@@ -0,0 +1,222 @@
+#include "file_watcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <utility>
+
+#ifdef __linux__
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#endif
+
+// Writes closer together than this are reported at once
+constexpr int SETTLE_MS = 100;
+
+static std::filesystem::path
+AbsolutePath(const std::filesystem::path& path)
+{
+	std::error_code error;
+	std::filesystem::path absolute = std::filesystem::weakly_canonical(path, error);
+	return error ? std::filesystem::absolute(path) : absolute;
+}
+
+bool
+File_Watcher::watch(const std::filesystem::path& path)
+{
+	std::scoped_lock lock{mutex};
+	auto it = std::find_if(files.begin(), files.end(), [&](const Watched_File& file) { return file.path == path; });
+	if (it != files.end())
+	{
+		++it->watch_count;
+		return true;
+	}
+
+	std::filesystem::path absolute = AbsolutePath(path);
+	Watched_File file{
+		.path = path,
+		.directory = absolute.parent_path(),
+		.name = absolute.filename(),
+		.watch_count = 1,
+		.write_time = {},
+	};
+#ifdef __linux__
+	// Directories are watched rather than the files, tools often write a new file and move it over the old one
+	bool watched = std::any_of(directories.begin(), directories.end(), [&](const auto& directory) { return directory.second == file.directory; });
+	if (watched == false)
+	{
+		int wd = inotify_add_watch(inotify_fd, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd == -1)
+			return false;
+		directories.push_back({wd, file.directory});
+	}
+#else
+	std::error_code error;
+	file.write_time = std::filesystem::last_write_time(absolute, error);
+#endif
+	files.push_back(file);
+	return true;
+}
+
+void
+File_Watcher::unwatch(const std::filesystem::path& path)
+{
+	std::scoped_lock lock{mutex};
+	auto it = std::find_if(files.begin(), files.end(), [&](const Watched_File& file) { return file.path == path; });
+	if (it == files.end() || --it->watch_count > 0)
+		return;
+
+	std::filesystem::path directory = it->directory;
+	files.erase(it);
+#ifdef __linux__
+	bool in_use = std::any_of(files.begin(), files.end(), [&](const Watched_File& file) { return file.directory == directory; });
+	auto watched = std::find_if(directories.begin(), directories.end(), [&](const auto& entry) { return entry.second == directory; });
+	if (in_use == false && watched != directories.end())
+	{
+		inotify_rm_watch(inotify_fd, watched->first);
+		directories.erase(watched);
+	}
+#endif
+}
+
+std::vector<std::filesystem::path>
+File_Watcher::changes()
+{
+	if (has_changes == false)
+		return {};
+
+	std::scoped_lock lock{mutex};
+	has_changes = false;
+	return std::exchange(changed, {});
+}
+
+// Hands what the thread saw over to changes, the caller holds the lock
+static void
+Publish(std::vector<std::filesystem::path>& pending, std::vector<std::filesystem::path>& changed, std::atomic<bool>& has_changes)
+{
+	for (const std::filesystem::path& path : pending)
+	{
+		if (std::find(changed.begin(), changed.end(), path) == changed.end())
+			changed.push_back(path);
+	}
+	pending.clear();
+	has_changes = true;
+}
+
+#ifdef __linux__
+File_Watcher::File_Watcher()
+{
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (inotify_fd == -1 || stop_fd == -1)
+	{
+		if (inotify_fd != -1)
+			close(inotify_fd);
+		if (stop_fd != -1)
+			close(stop_fd);
+		throw std::runtime_error("Failed to start watching files");
+	}
+	thread = std::jthread{[this](std::stop_token stop) { run(stop); }};
+}
+
+File_Watcher::~File_Watcher()
+{
+	thread.request_stop();
+	uint64_t wake = 1;
+	(void)!write(stop_fd, &wake, sizeof(wake));
+	thread.join();
+	close(inotify_fd);
+	close(stop_fd);
+}
+
+void
+File_Watcher::run(std::stop_token stop)
+{
+	alignas(inotify_event) char buffer[4096];
+	std::vector<std::filesystem::path> pending;
+	while (stop.stop_requested() == false)
+	{
+		// Sleeps until something happens, then until the writes stop for a while
+		pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+		int ready = poll(fds, 2, pending.empty() ? -1 : SETTLE_MS);
+		if (ready == -1 && errno != EINTR)
+			break;
+		if (ready == 0)
+		{
+			std::scoped_lock lock{mutex};
+			Publish(pending, changed, has_changes);
+			continue;
+		}
+		if (ready == -1 || (fds[1].revents & POLLIN))
+			continue;
+
+		ssize_t size = read(inotify_fd, buffer, sizeof(buffer));
+		std::scoped_lock lock{mutex};
+		for (ssize_t offset = 0; offset < size;)
+		{
+			const inotify_event* event = (const inotify_event*)(buffer + offset);
+			offset += sizeof(inotify_event) + event->len;
+			auto directory = std::find_if(directories.begin(), directories.end(), [&](const auto& entry) { return entry.first == event->wd; });
+			if (event->len == 0 || directory == directories.end())
+				continue;
+
+			for (const Watched_File& file : files)
+			{
+				if (file.directory == directory->second && file.name == event->name && std::find(pending.begin(), pending.end(), file.path) == pending.end())
+					pending.push_back(file.path);
+			}
+		}
+	}
+}
+#else
+File_Watcher::File_Watcher()
+{
+	thread = std::jthread{[this](std::stop_token stop) { run(stop); }};
+}
+
+File_Watcher::~File_Watcher()
+{
+	thread.request_stop();
+	thread.join();
+}
+
+void
+File_Watcher::run(std::stop_token stop)
+{
+	// Without a way to be told about writes, the files are checked a few times a second away from the main loop
+	const int POLL_MS = 250;
+
+	std::mutex sleep_mutex;
+	std::condition_variable_any sleeping;
+	std::vector<std::filesystem::path> pending;
+	while (stop.stop_requested() == false)
+	{
+		{
+			std::unique_lock sleep_lock{sleep_mutex};
+			sleeping.wait_for(sleep_lock, stop, std::chrono::milliseconds(pending.empty() ? POLL_MS : SETTLE_MS), [] { return false; });
+		}
+
+		std::scoped_lock lock{mutex};
+		bool written = false;
+		for (Watched_File& file : files)
+		{
+			std::error_code error;
+			std::filesystem::file_time_type write_time = std::filesystem::last_write_time(file.directory / file.name, error);
+			if (error || write_time == file.write_time)
+				continue;
+
+			file.write_time = write_time;
+			written = true;
+			if (std::find(pending.begin(), pending.end(), file.path) == pending.end())
+				pending.push_back(file.path);
+		}
+		if (written == false && pending.empty() == false)
+			Publish(pending, changed, has_changes);
+	}
+}
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Watches files from a background thread, inotify on Linux and a slow poll elsewhere. Whoever asks for the
+// changes does not touch the file system, checking for them costs an atomic load while nothing changed.
+struct File_Watcher
+{
+	File_Watcher();
+	~File_Watcher();
+
+	File_Watcher(const File_Watcher&) = delete;
+	File_Watcher&
+	operator=(const File_Watcher&) = delete;
+
+	// The file needs not exist yet, writing it or moving another file over it both count as changing it.
+	// Watching a path twice needs unwatching it twice. False when its directory can't be watched.
+	bool
+	watch(const std::filesystem::path& path);
+
+	void
+	unwatch(const std::filesystem::path& path);
+
+	// Files written since the last call, each once and as they were given to watch. Writes following each other
+	// closely, such as the tools of a map compiler running one after the other, are reported together once they stop.
+	std::vector<std::filesystem::path>
+	changes();
+
+private:
+	struct Watched_File
+	{
+		std::filesystem::path path; // As given to watch
+		std::filesystem::path directory, name;
+		int watch_count;
+		std::filesystem::file_time_type write_time; // Only used when polling
+	};
+
+	std::mutex mutex;
+	std::vector<Watched_File> files;
+	std::vector<std::filesystem::path> changed;
+	std::atomic<bool> has_changes = false;
+#ifdef __linux__
+	int inotify_fd = -1;
+	int stop_fd = -1; // Wakes the thread up when the watcher goes away
+	std::vector<std::pair<int, std::filesystem::path>> directories; // Watch descriptor of every directory with watched files
+#endif
+	std::jthread thread; // Declared last so it is joined before the rest is destroyed
+
+	void
+	run(std::stop_token stop);
+};
@@ -3,75 +3,93 @@
 // Input vertex attributes (from vertex shader)
 in vec3 fragPosition;
 in vec2 fragTexCoord;
+in vec2 fragLightmapCoord;
 in vec3 fragNormal;
+flat in float fragTextureId;
 
 // Input uniform values
 uniform sampler2D texture0;
+layout(binding = 1) uniform sampler2DArray textureArray;
+layout(binding = 2) uniform sampler2D lightmap;
+layout(binding = 3) uniform sampler2D palette;
+uniform int useTextureArray;
+layout(std430, binding = 4) readonly buffer Texture_Layers { uint textureLayers[]; }; // Of each texture in its array
+uniform int usePalette; // Textures hold palette indices instead of colors
 
-// Output fragment color
-out vec4 finalColor;
-
-#define     MAX_LIGHTS              4
-#define     LIGHT_DIRECTIONAL       0
-#define     LIGHT_POINT             1
-
+// Light entities sorted into clusters of the view, each a tile of the screen between two depths
 struct Light
 {
-	int enabled;
-	int type;
-	vec3 position;
-	vec3 target;
-	vec4 color;
+	vec4 sphere; // Radius in w
+	vec4 color;  // Light lost per unit in w
 };
+layout(std430, binding = 0) readonly buffer Lights { Light lights[]; };
+layout(std430, binding = 1) readonly buffer Cluster_Offsets { uint clusterOffsets[]; }; // Into clusterLights, then where the last cluster ends
+layout(std430, binding = 2) readonly buffer Cluster_Lights { uint clusterLights[]; };
+uniform int useDynamicLights; // In place of the lightmap
+uniform ivec3 clusterGrid;
+uniform vec2 clusterDepths;   // Where the first slice starts and the last one ends, slices grow with depth
+uniform vec2 clipPlanes;
+uniform vec4 viewport;
 
-// Input lighting values
-uniform Light lights[MAX_LIGHTS];
-uniform vec3 viewPos;
-uniform int lightPower;
+// Output fragment color
+out vec4 finalColor;
 
-float
-Attenuate(float dist)
+vec3 PaletteColor(float index)
 {
-	float HD = lightPower;
-	float K = 1.0 / (HD * HD);
-	float dsq = dist * dist;
-	return 1.0 / (1.0 + K*dsq);
+	return texelFetch(palette, ivec2(index * 255.0 + 0.5, 0), 0).rgb;
 }
 
-void main()
+// Indices can't be filtered, the two nearest levels are sampled as they are and blended once resolved
+vec3 PalettedTexel(vec2 uv)
 {
-	// Texel color fetching from texture sampler
-	vec4 texelColor = texture(texture0, fragTexCoord);
-	vec3 normal = normalize(fragNormal);
-	vec3 ambient = vec3(0.01);
+	float lod = clamp(textureQueryLod(texture0, uv).y, 0.0, float(textureQueryLevels(texture0) - 1));
+	float level = floor(lod);
+	return mix(PaletteColor(textureLod(texture0, uv, level).r), PaletteColor(textureLod(texture0, uv, level + 1.0).r), lod - level);
+}
 
-	vec3 lightDot = vec3(0.0);
-	for (int i = 0; i < MAX_LIGHTS; i++)
-	{
-		if (lights[i].enabled == 1)
-		{
-			vec3 light_direction = vec3(0);
-			float light_distance = 0;
+vec3 PalettedArrayTexel(vec3 uvw)
+{
+	float lod = clamp(textureQueryLod(textureArray, uvw.xy).y, 0.0, float(textureQueryLevels(textureArray) - 1));
+	float level = floor(lod);
+	return mix(PaletteColor(textureLod(textureArray, uvw, level).r), PaletteColor(textureLod(textureArray, uvw, level + 1.0).r), lod - level);
+}
 
-			if (lights[i].type == LIGHT_DIRECTIONAL)
-			{
-				light_direction = normalize(lights[i].target - lights[i].position);
-				light_distance = distance(lights[i].target, lights[i].position);
-			}
-			else if (lights[i].type == LIGHT_POINT)
-			{
-				light_direction = normalize(fragPosition - lights[i].position);
-				light_distance = distance(fragPosition, lights[i].position);
-			}
+// Lights reaching the fragment, falling off linearly and capped at 255 as in the light tool
+vec3 DynamicLight()
+{
+	float ndcDepth = gl_FragCoord.z * 2.0 - 1.0;
+	float depth = 2.0 * clipPlanes.x * clipPlanes.y / (clipPlanes.y + clipPlanes.x - ndcDepth * (clipPlanes.y - clipPlanes.x));
+	int slice = int(log(max(depth, clusterDepths.x) / clusterDepths.x) / log(clusterDepths.y / clusterDepths.x) * float(clusterGrid.z));
+	ivec2 tile = ivec2((gl_FragCoord.xy - viewport.xy) / viewport.zw * vec2(clusterGrid.xy));
+	ivec3 cluster = clamp(ivec3(tile, slice), ivec3(0), clusterGrid - 1);
+	uint clusterId = uint((cluster.z * clusterGrid.y + cluster.y) * clusterGrid.x + cluster.x);
 
-			float NdotL = abs(dot(normal, light_direction)) * Attenuate(light_distance);
-			lightDot += lights[i].color.rgb * NdotL;
-		}
+	vec3 normal = normalize(fragNormal);
+	vec3 total = vec3(0);
+	for (uint i = clusterOffsets[clusterId]; i < clusterOffsets[clusterId + 1]; ++i)
+	{
+		Light light = lights[clusterLights[i]];
+		vec3 toLight = light.sphere.xyz - fragPosition;
+		float distance = length(toLight);
+		float angle = dot(normal, toLight) / max(distance, 0.0001);
+		if (distance >= light.sphere.w || angle < 0.0)
+			continue;
+		total += light.color.rgb * (light.sphere.w - distance) * light.color.w * (0.5 + 0.5 * angle);
 	}
+	return min(total, vec3(255.0)) / 255.0 * 2.0;
+}
+
+void main()
+{
+	// Texel color fetching from texture sampler
+	vec3 texelColor;
+	if (usePalette != 0)
+		texelColor = (useTextureArray != 0) ? PalettedArrayTexel(vec3(fragTexCoord, textureLayers[uint(fragTextureId)])) : PalettedTexel(fragTexCoord);
+	else
+		texelColor = (useTextureArray != 0) ? texture(textureArray, vec3(fragTexCoord, textureLayers[uint(fragTextureId)])).rgb : texture(texture0, fragTexCoord).rgb;
 
-	finalColor  = texelColor * vec4(lightDot, 1);
-	finalColor += texelColor * vec4(ambient, 1);
+	// Baked lighting, a luxel of 128 leaves the texture as it is and brighter ones overbright it
+	vec3 light = (useDynamicLights != 0) ? DynamicLight() : vec3(texture(lightmap, fragLightmapCoord).r * 2.0);
 
-	// Gamma correction
-	finalColor = pow(finalColor, vec4(1.0/2.2));
+	finalColor = vec4(texelColor * light, 1);
 }
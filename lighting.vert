@@ -1,9 +1,18 @@
 #version 430
 
-// Input vertex attributes
-in vec3 vertexPosition;
-in vec2 vertexTexCoord;
-in vec3 vertexNormal;
+// Input vertex attributes, packed as Packed_Vertex
+in vec3 vertexPosition;     // 0 to 1 between the bounds of the world, matModel scales it back
+in vec2 vertexTexCoord2;
+in vec2 vertexNormal;       // Octahedral
+layout(location = 6) in float vertexSurfaceId;
+
+// Texture coordinates are projected from the packed position, as Packed_Surface
+struct Surface
+{
+	vec4 s, t;
+	uint textureId;
+};
+layout(std430, binding = 3) readonly buffer Surfaces { Surface surfaces[]; };
 
 // Input uniform values
 uniform mat4 mvp;
@@ -13,15 +22,29 @@ uniform mat4 matNormal;
 // Output vertex attributes (to fragment shader)
 out vec3 fragPosition;
 out vec2 fragTexCoord;
+out vec2 fragLightmapCoord;
 out vec4 fragColor;
 out vec3 fragNormal;
+flat out float fragTextureId;
+
+vec3 OctahedralDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
 
 void main()
 {
+	Surface surface = surfaces[int(vertexSurfaceId)];
+
 	// Send vertex attributes to fragment shader
-	fragPosition = vertexPosition;
-	fragTexCoord = vertexTexCoord;
-	fragNormal = normalize(vec3(matNormal * vec4(vertexNormal, 1)));
+	fragPosition = vec3(matModel * vec4(vertexPosition, 1));
+	fragTexCoord = vec2(dot(surface.s.xyz, vertexPosition) + surface.s.w, dot(surface.t.xyz, vertexPosition) + surface.t.w);
+	fragLightmapCoord = vertexTexCoord2;
+	fragNormal = normalize(vec3(matNormal * vec4(OctahedralDecode(vertexNormal), 1)));
+	fragTextureId = float(surface.textureId);
 
 	// Calculate final vertex position
 	gl_Position = mvp * vec4(vertexPosition, 1);
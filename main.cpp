@@ -3,20 +3,23 @@
 #include <rcamera.h>
 #include <rlgl.h>
 
-// @REF https://github.com/raysan5/raylib/blob/master/examples/shaders/rlights.h
-#define RLIGHTS_IMPLEMENTATION
-#include <rlights.h>
-
 #include <imgui.h>
 #include <rlImGui.h>
 
+#include "bsp.h"
+#include "file_watcher.h"
+#include "map_cache.h"
+#include "trace.h"
+#include "world.h"
+
+#include <algorithm>
+#include <cmath>
+#include <exception>
 #include <filesystem>
-#include <set>
+#include <memory>
+#include <thread>
 #include <vector>
 
-std::vector<Model>
-LoadModelsFromBSPFile(const std::filesystem::path& path);
-
 namespace ImGui
 {
 	ImGuiWindowFlags
@@ -34,6 +37,156 @@ namespace ImGui
 	}
 }
 
+struct Map_Load // A map being processed on a background thread
+{
+	std::string path;
+	std::atomic<float> progress = 0;
+	std::atomic<bool> done = false;
+	std::optional<Map_Data> data;
+	std::exception_ptr error;
+	std::jthread thread; // Declared last so it is joined before the rest is destroyed
+};
+
+// Reloads read the map into memory, the compiler that wrote it may still write it again while it loads
+std::unique_ptr<Map_Load>
+StartMapLoad(const std::string& path, bool reload = false)
+{
+	auto load = std::make_unique<Map_Load>();
+	load->path = path;
+	load->thread = std::jthread{[load = load.get(), reload](std::stop_token stop) {
+		try
+		{
+			load->data = LoadMapDataCached(load->path, MAP_CACHE_DIR, stop, &load->progress, reload);
+		}
+		catch (...)
+		{
+			load->error = std::current_exception();
+		}
+		load->done = true;
+	}};
+	return load;
+}
+
+std::string
+ErrorMessage(std::exception_ptr error)
+{
+	try
+	{
+		std::rethrow_exception(error);
+	}
+	catch (const std::exception& e)
+	{
+		return e.what();
+	}
+	catch (const char* e)
+	{
+		return e;
+	}
+	catch (...)
+	{
+		return "Unknown error";
+	}
+}
+
+// A compiler writes the map once per tool it runs, a reload waits until the file stops changing for this long
+constexpr double RELOAD_SETTLE_SECONDS = 0.5;
+
+struct Map_Reload // The current map was written, it is reloaded once it looks finished
+{
+	std::string path;
+	uintmax_t size;
+	std::filesystem::file_time_type write_time;
+	double stable_since; // GetTime when the size or write time were last seen changing
+};
+
+// True once the size and write time of the file have stayed the same for the settle time
+bool
+ReloadSettled(Map_Reload& reload)
+{
+	std::error_code error;
+	uintmax_t size = std::filesystem::file_size(reload.path, error);
+	std::filesystem::file_time_type writeTime = error ? std::filesystem::file_time_type{} : std::filesystem::last_write_time(reload.path, error);
+	if (error || size != reload.size || writeTime != reload.write_time)
+	{
+		// Missing means another file is about to be moved over it
+		reload.size = size;
+		reload.write_time = writeTime;
+		reload.stable_since = GetTime();
+		return false;
+	}
+	return GetTime() - reload.stable_since >= RELOAD_SETTLE_SECONDS;
+}
+
+// Player movement in Quake units
+constexpr float VIEW_HEIGHT = 22;  // Eyes above the origin of the player hull
+constexpr float STEP_HEIGHT = 18;  // Stairs are walked up without jumping
+constexpr float GRAVITY = 800;     // Per second squared
+constexpr float JUMP_SPEED = 270;
+
+struct Walker
+{
+	float fall_speed = 0; // Up is negative
+	bool on_ground = false;
+};
+
+// Turns the move the camera just made into a player walking from where it was, colliding with the world and
+// falling. The camera keeps flying until it is somewhere the player fits.
+void
+WalkCamera(Camera& camera, Vector3 previousPosition, const Map_Tree& tree, Walker& walker)
+{
+	Vector3 origin = Vector3Subtract(ToQuake(previousPosition), {0, 0, VIEW_HEIGHT});
+	if (tree.hull_nodes.empty() || HullContents(tree, HULL_PLAYER, origin) == CONTENTS_SOLID)
+	{
+		walker = {};
+		return;
+	}
+
+	Vector3 move = ToQuake(Vector3Subtract(camera.position, previousPosition));
+	move.z = 0;
+	Vector3 walked = SlideHull(tree, HULL_PLAYER, origin, move);
+
+	// On the ground, the same move one step higher is taken when it gets further, then put back down
+	if (walker.on_ground)
+	{
+		Vector3 raised = SlideHull(tree, HULL_PLAYER, origin, {0, 0, STEP_HEIGHT});
+		Vector3 stepped = SlideHull(tree, HULL_PLAYER, raised, move);
+		stepped = SlideHull(tree, HULL_PLAYER, stepped, {0, 0, origin.z - raised.z});
+		auto distance = [&](Vector3 to) { return Vector2Distance({origin.x, origin.y}, {to.x, to.y}); };
+		if (distance(stepped) > distance(walked) + 0.1f)
+			walked = stepped;
+	}
+
+	float dt = GetFrameTime();
+	if (walker.on_ground && IsKeyPressed(KEY_SPACE))
+		walker.fall_speed = -JUMP_SPEED;
+	walker.fall_speed += GRAVITY * dt;
+
+	float fall = walker.fall_speed * dt;
+	Vector3 fallen = SlideHull(tree, HULL_PLAYER, walked, {0, 0, -fall}, &walker.on_ground);
+	bool hitCeiling = fall < 0 && fallen.z < walked.z - fall - 0.1f;
+	if (walker.on_ground || hitCeiling)
+		walker.fall_speed = 0;
+
+	Vector3 offset = Vector3Subtract(FromQuake(Vector3Add(fallen, {0, 0, VIEW_HEIGHT})), camera.position);
+	camera.position = Vector3Add(camera.position, offset);
+	camera.target = Vector3Add(camera.target, offset);
+}
+
+// Outline of the face a ray hit, lifted off it a little so the depth test keeps it
+void
+DrawFaceOutline(const Map_Tree& tree, const Ray_Hit& hit, Color color)
+{
+	uint32_t first = tree.face_first_vertices[hit.face_id];
+	uint32_t count = tree.face_first_vertices[hit.face_id + 1] - first;
+	Vector3 lift = Vector3Scale(hit.normal, 0.5f);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Vector3 start = Vector3Add(tree.face_vertices[first + i], lift);
+		Vector3 end = Vector3Add(tree.face_vertices[first + (i + 1) % count], lift);
+		DrawLine3D(FromQuake(start), FromQuake(end), color);
+	}
+}
+
 int
 main()
 {
@@ -44,18 +197,24 @@ main()
 	rlEnableBackfaceCulling();
 	rlImGuiSetup(false);
 
-	std::string currentFile = MAP_SOURCE_DIR "/bsp/dm4.bsp";
-	std::vector<Model> models;
-	try {
-		models = LoadModelsFromBSPFile(currentFile);
-	}
-	catch (...) {
-		currentFile = "";
-	}
+	std::string currentFile = "";
+	std::string loadError = "";
+	World world{};
+	std::vector<Texture_Data> worldTextures; // Kept to upload again when switching to or from paletted textures or the texture array
+	static bool enable_paletted_textures = false;
+	static bool enable_texture_array = false;
+	Ray_Hit inspectedSurface{}; // Picked by clicking while the cursor is shown
+
+	// The current map keeps rendering until the pending one is ready to upload
+	std::unique_ptr<Map_Load> pendingLoad = StartMapLoad(MAP_SOURCE_DIR "/bsp/dm4.bsp");
+	std::vector<std::unique_ptr<Map_Load>> cancelledLoads;
+	std::optional<Map_Reload> pendingReload;
 
-	long shaderModTime = std::max(GetFileModTime(VS_PATH), GetFileModTime(FS_PATH));
+	// Shaders are reloaded when edited, and the current map when a compiler writes it again
+	File_Watcher watcher;
+	watcher.watch(VS_PATH);
+	watcher.watch(FS_PATH);
 	Shader shader = LoadShader(VS_PATH, FS_PATH);
-	shader.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(shader, "viewPos");
 
 	Camera camera = {
 		.position = {10.0f, 10.0f, 10.0f},
@@ -64,16 +223,28 @@ main()
 		.fovy = 90.f,
 		.projection = CAMERA_PERSPECTIVE,
 	};
-	Light cameraLight = CreateLight(LIGHT_POINT, camera.position, {}, WHITE, shader);
-	int lightPower = 10;
-	SetShaderValue(shader, GetShaderLocation(shader, "lightPower"), &lightPower, SHADER_UNIFORM_INT);
 
 	DisableCursor(); // Limit cursor to relative movement inside the window
 	while (!WindowShouldClose())
 	{
-		// Check if shader file has been modified
-		long currentShaderModTime = std::max(GetFileModTime(VS_PATH), GetFileModTime(FS_PATH));
-		if (currentShaderModTime != shaderModTime)
+		std::string nextMap = "";
+		bool reloadMap = false;
+		bool shaderChanged = false;
+		for (const std::filesystem::path& changedPath : watcher.changes())
+		{
+			if (changedPath == VS_PATH || changedPath == FS_PATH)
+				shaderChanged = true;
+			else if (changedPath == currentFile)
+				pendingReload = Map_Reload{.path = currentFile, .size = 0, .write_time = {}, .stable_since = GetTime()};
+		}
+		if (pendingReload && ReloadSettled(*pendingReload))
+		{
+			nextMap = pendingReload->path;
+			reloadMap = true;
+			pendingReload.reset();
+		}
+
+		if (shaderChanged)
 		{
 			// Try hot-reloading updated shader
 			Shader updatedShader = LoadShader(VS_PATH, FS_PATH);
@@ -81,34 +252,52 @@ main()
 			{
 				UnloadShader(shader);
 				shader = updatedShader;
-				shader.locs[SHADER_LOC_VECTOR_VIEW] = GetShaderLocation(shader, "viewPos");
-
-				lightsCount = 0;
-				cameraLight = CreateLight(LIGHT_POINT, camera.position, {}, WHITE, shader);
-				SetShaderValue(shader, GetShaderLocation(shader, "lightPower"), &lightPower, SHADER_UNIFORM_INT);
 			}
-
-			shaderModTime = currentShaderModTime;
 		}
 
 		if (IsFileDropped())
 		{
 			FilePathList droppedFiles = LoadDroppedFiles();
+			nextMap = droppedFiles.paths[0];
+			reloadMap = false;
+			pendingReload.reset();
+			UnloadDroppedFiles(droppedFiles);
+		}
 
-			std::set<decltype(Texture::id)> textures{};
-			for (Model model : models)
+		if (nextMap.empty() == false)
+		{
+			if (pendingLoad)
 			{
-				Texture texture = model.materials[0].maps[MATERIAL_MAP_DIFFUSE].texture;
-				textures.insert(texture.id);
+				pendingLoad->thread.request_stop();
+				cancelledLoads.push_back(std::move(pendingLoad));
 			}
-			std::for_each(std::begin(textures), std::end(textures), rlUnloadTexture);
-
-			std::for_each(models.begin(), models.end(), UnloadModel);
+			pendingLoad = StartMapLoad(nextMap, reloadMap);
+		}
 
-			currentFile = droppedFiles.paths[0];
-			models = LoadModelsFromBSPFile(currentFile);
-			UnloadDroppedFiles(droppedFiles);
+		if (pendingLoad && pendingLoad->done)
+		{
+			if (pendingLoad->data)
+			{
+				UnloadWorld(world);
+				world = UploadWorld(*pendingLoad->data, enable_paletted_textures, enable_texture_array);
+				worldTextures = std::move(pendingLoad->data->textures);
+				inspectedSurface = {};
+				if (pendingLoad->path != currentFile)
+				{
+					if (currentFile.empty() == false)
+						watcher.unwatch(currentFile);
+					watcher.watch(pendingLoad->path);
+				}
+				currentFile = pendingLoad->path;
+				loadError = "";
+			}
+			else if (pendingLoad->error)
+			{
+				loadError = TextFormat("Failed to load %s: %s", pendingLoad->path.c_str(), ErrorMessage(pendingLoad->error).c_str());
+			}
+			pendingLoad.reset();
 		}
+		std::erase_if(cancelledLoads, [](const auto& load) { return load->done.load(); });
 
 		static bool enable_cursor = false;
 		if (IsMouseButtonPressed(MOUSE_BUTTON_RIGHT))
@@ -118,8 +307,22 @@ main()
 			else
 				DisableCursor();
 		}
+		// Rays go through the whole map, it is never more than a few thousand units across
+		if (enable_cursor && IsMouseButtonPressed(MOUSE_BUTTON_LEFT) && ImGui::GetIO().WantCaptureMouse == false && world.tree.nodes.empty() == false)
+		{
+			Ray mouseRay = GetMouseRay(GetMousePosition(), camera);
+			inspectedSurface = CastRay(world.tree, {ToQuake(mouseRay.position), ToQuake(mouseRay.direction)}, 16384);
+		}
+
+		static bool enable_walk = false;
+		static Walker walker;
 		if (enable_cursor == false)
-			UpdateCamera(&camera, CAMERA_FREE);
+		{
+			Vector3 previousPosition = camera.position;
+			UpdateCamera(&camera, enable_walk ? CAMERA_FIRST_PERSON : CAMERA_FREE);
+			if (enable_walk)
+				WalkCamera(camera, previousPosition, world.tree, walker);
+		}
 
 		static bool enable_imgui = true;
 		if (IsKeyPressed(KEY_I))
@@ -128,26 +331,26 @@ main()
 		if (IsKeyPressed(KEY_R))
 			camera.up = {0.0, 1.0, 0.0};
 
-		cameraLight.position = camera.position;
-		UpdateLightValues(shader, cameraLight);
-
 		static bool enable_wireframe = false;
+		static bool enable_pvs = true;
+		static bool enable_frustum_culling = true;
+		static bool enable_front_to_back = true;
+		static bool enable_dynamic_lights = false;
 		BeginDrawing();
 		{
 			ClearBackground(GRAY);
 
 			BeginMode3D(camera);
 			{
-				for (Model model : models)
-				{
-					model.materials[0].shader = shader;
-					DrawModel(model, {}, 1.f, WHITE);
-					if (enable_wireframe)
-					{
-						model.materials[0].shader = {rlGetShaderIdDefault(), rlGetShaderLocsDefault()};
-						DrawModelWires(model, {}, 1.f, BLACK);
-					}
-				}
+				Matrix viewProjection = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+				UpdateWorldVisibility(world, camera.position, viewProjection, enable_pvs, enable_frustum_culling, enable_front_to_back);
+				if (enable_dynamic_lights)
+					UpdateWorldLights(world, rlGetMatrixModelview(), rlGetMatrixProjection());
+				DrawWorld(world, shader, enable_dynamic_lights);
+				if (enable_wireframe)
+					DrawWorldWires(world, BLACK);
+				if (inspectedSurface.face_id >= 0)
+					DrawFaceOutline(world.tree, inspectedSurface, YELLOW);
 			}
 			EndMode3D();
 
@@ -159,6 +362,13 @@ main()
 				{
 					ImGui::Text("Drag and Drop a .BSP file onto the window to view it.");
 					ImGui::Text("Current File: %s", currentFile.c_str());
+					if (pendingLoad)
+					{
+						ImGui::Text("Loading: %s", pendingLoad->path.c_str());
+						ImGui::ProgressBar(pendingLoad->progress);
+					}
+					if (loadError.empty() == false)
+						ImGui::TextColored({1.f, 0.3f, 0.3f, 1.f}, "%s", loadError.c_str());
 					ImGui::Separator();
 
 					ImGui::BulletText("WASD:        Move");
@@ -168,11 +378,54 @@ main()
 					ImGui::BulletText("Mouse:       Pan");
 					ImGui::BulletText("I:           Toggle UI");
 					ImGui::BulletText("RMB:         Toggle Cursor");
+					ImGui::BulletText("LMB:         Inspect Surface (with the cursor)");
 
-					if (ImGui::SliderInt("Light Power", &lightPower, 1, 50))
-						SetShaderValue(shader, GetShaderLocation(shader, "lightPower"), &lightPower, SHADER_UNIFORM_INT);
-
+					ImGui::Checkbox("Walk", &enable_walk);
+					ImGui::SameLine();
+					ImGui::TextDisabled(walker.on_ground ? "(SPACE: Jump)" : "(falling or outside the map)");
 					ImGui::Checkbox("Wireframe", &enable_wireframe);
+					if (ImGui::Checkbox("Texture Arrays", &enable_texture_array))
+						UploadWorldTextures(world, worldTextures, enable_paletted_textures, enable_texture_array);
+					ImGui::SameLine();
+					size_t worldTextureCount = world.models.empty() ? 0 : world.models[0].range_count;
+					ImGui::TextDisabled("(%zu draw calls)", world.texture_arrays.empty() ? worldTextureCount : world.texture_arrays.size());
+					if (ImGui::Checkbox("Paletted Textures", &enable_paletted_textures))
+						UploadWorldTextures(world, worldTextures, enable_paletted_textures, enable_texture_array);
+					ImGui::SameLine();
+					ImGui::TextDisabled("(%.1f MB of textures)", world.texture_bytes / (1024.0 * 1024.0));
+
+					ImGui::Checkbox("Dynamic Lights", &enable_dynamic_lights);
+					ImGui::SameLine();
+					ImGui::TextDisabled("(%zu lights, at most %zu in a cluster)", world.light_spheres.size(), enable_dynamic_lights ? world.max_cluster_lights : size_t(0));
+
+					ImGui::Checkbox("PVS Culling", &enable_pvs);
+					if (world.camera_leaf != -1)
+					{
+						ImGui::SameLine();
+						ImGui::TextDisabled("(leaf %d)", world.camera_leaf);
+					}
+					ImGui::Checkbox("Frustum Culling", &enable_frustum_culling);
+					if (enable_frustum_culling)
+					{
+						ImGui::SameLine();
+						ImGui::TextDisabled("(%zu nodes visible, %zu culled)", world.cull_stats.nodes_visible, world.cull_stats.nodes_culled);
+					}
+					ImGui::Checkbox("Front To Back", &enable_front_to_back);
+					ImGui::SameLine();
+					ImGui::TextDisabled("(%.2f samples shaded per sample)", world.overdraw);
+					ImGui::Text("%zu/%zu faces, %zu draw ranges", world.visible_face_count, world.tree.face_ranges.size(), world.draw_list.size());
+					ImGui::Text("%.2f MB of vertices, %zu bytes each", world.vertex_bytes / (1024.0 * 1024.0), sizeof(Packed_Vertex));
+					ImGui::Text("%zu/%zu brush models", world.visible_instances.size(), world.model_instances.size());
+
+					const Ray_Hit& surface = inspectedSurface;
+					if (surface.face_id >= 0)
+					{
+						bool drawn = surface.texture_id >= 0 && (size_t)surface.texture_id < worldTextures.size();
+						ImGui::Text("Face %d, texinfo %d, texture %s", surface.face_id, surface.texinfo_id, drawn ? worldTextures[surface.texture_id].name.c_str() : "(not drawn)");
+						ImGui::Text("At %.1f %.1f %.1f, %.1f units away", surface.position.x, surface.position.y, surface.position.z, surface.distance);
+					}
+					else if (surface.hit)
+						ImGui::Text("Solid at %.1f %.1f %.1f, between faces", surface.position.x, surface.position.y, surface.position.z);
 
 					static float line_width = rlGetLineWidth();
 					if (ImGui::SliderFloat("Line Width", &line_width, 0.1f, 10))
@@ -186,7 +439,7 @@ main()
 	}
 
 	UnloadShader(shader);
-	std::for_each(models.begin(), models.end(), UnloadModel);
+	UnloadWorld(world);
 	rlImGuiShutdown();
 	CloseWindow();
 	return 0;
@@ -0,0 +1,436 @@
+#include <raylib.h>
+#include <external/sdefl.h>
+#include <external/sinfl.h>
+
+#include "bsp_file.h"
+#include "map_cache.h"
+#include "mapped_file.h"
+
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <stdio.h>
+#include <string.h>
+
+struct Map_Cache_Header
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t source_hash;
+	uint64_t payload_size; // Once inflated
+	uint64_t stored_size;  // As it is in the file
+	uint32_t compressed;
+	uint32_t _padding;
+};
+
+constexpr char MAP_CACHE_MAGIC[4] = {'Q', 'L', 'V', 'C'};
+
+uint64_t
+HashBytes(std::span<const uint8_t> bytes)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (uint8_t byte : bytes)
+		hash = (hash ^ byte) * 0x100000001b3;
+	return hash;
+}
+
+struct Cache_Writer
+{
+	std::vector<uint8_t> bytes;
+
+	template<typename T>
+	void
+	value(const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		const uint8_t* data = (const uint8_t*)&value;
+		bytes.insert(bytes.end(), data, data + sizeof(T));
+	}
+
+	template<typename T>
+	void
+	array(const std::vector<T>& values)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		value<uint64_t>(values.size());
+		const uint8_t* data = (const uint8_t*)values.data();
+		bytes.insert(bytes.end(), data, data + values.size() * sizeof(T));
+	}
+
+	void
+	string(const std::string& value)
+	{
+		array(std::vector<char>(value.begin(), value.end()));
+	}
+};
+
+struct Cache_Reader
+{
+	std::span<const uint8_t> bytes;
+
+	std::span<const uint8_t>
+	_take(size_t size)
+	{
+		if (size > bytes.size())
+			throw std::runtime_error("Truncated map cache");
+		std::span<const uint8_t> taken = bytes.first(size);
+		bytes = bytes.subspan(size);
+		return taken;
+	}
+
+	template<typename T>
+	T
+	value()
+	{
+		T value;
+		memcpy(&value, _take(sizeof(T)).data(), sizeof(T));
+		return value;
+	}
+
+	template<typename T>
+	void
+	array(std::vector<T>& values)
+	{
+		uint64_t count = value<uint64_t>();
+		if (count > bytes.size() / sizeof(T))
+			throw std::runtime_error("Truncated map cache");
+		values.resize(count);
+		memcpy(values.data(), _take(count * sizeof(T)).data(), count * sizeof(T));
+	}
+
+	std::string
+	string()
+	{
+		std::vector<char> chars;
+		array(chars);
+		return {chars.begin(), chars.end()};
+	}
+};
+
+// Both directions list the fields in the same order, keep them in sync with bsp.h
+static void
+WriteMapData(Cache_Writer& out, const Map_Data& data)
+{
+	out.value<uint64_t>(data.textures.size());
+	for (const Texture_Data& texture : data.textures)
+	{
+		out.string(texture.name);
+		out.value(texture.width);
+		out.value(texture.height);
+		out.value(texture.mipmaps);
+		out.array(texture.pixels);
+		out.array(texture.indices);
+	}
+
+	const Mesh_Data& mesh = data.mesh;
+	out.array(mesh.vertices);
+	out.array(mesh.texcoords);
+	out.array(mesh.lightmap_texcoords);
+	out.array(mesh.normals);
+	out.array(mesh.texture_ids);
+	out.array(mesh.texinfo_ids);
+	out.array(mesh.indices);
+	out.value<uint64_t>(mesh.soup_vertex_count);
+
+	out.array(data.texture_projections);
+	out.value(data.packed_mesh.bounds);
+	out.array(data.packed_mesh.vertices);
+	out.array(data.packed_mesh.surfaces);
+	out.array(data.ranges);
+
+	out.value(data.lightmap.width);
+	out.value(data.lightmap.height);
+	out.array(data.lightmap.pixels);
+
+	const Map_Tree& tree = data.tree;
+	out.value(tree.root_node);
+	out.value(tree.visleaf_count);
+	out.array(tree.planes);
+	out.array(tree.nodes);
+	out.array(tree.leaves);
+	out.array(tree.listfaces);
+	out.array(tree.visibility);
+	out.array(tree.face_ranges);
+	out.array(tree.face_first_vertices);
+	out.array(tree.face_vertices);
+	out.array(tree.face_texinfo_ids);
+	out.array(tree.face_sides);
+	out.array(tree.hull_nodes);
+	for (int32_t root : tree.hull_roots)
+		out.value(root);
+
+	out.array(data.models);
+	out.array(data.model_instances);
+	out.array(data.lights);
+}
+
+// A cache that reads back whole can still be corrupt, every index followed while drawing or walking the tree is
+// checked against what it points into, as BSP_File and the loader check the map the cache was made from
+static void
+CheckMapData(const Map_Data& data)
+{
+	auto check = [](bool in_bounds, const char* message) {
+		if (in_bounds == false)
+			throw std::runtime_error(message);
+	};
+
+	for (const Texture_Data& texture : data.textures)
+	{
+		check(texture.width > 0 && texture.height > 0 && texture.mipmaps > 0 && texture.mipmaps <= MIPLEVELS, "Cached texture size out of range");
+		check((texture.width >> (texture.mipmaps - 1)) > 0 && (texture.height >> (texture.mipmaps - 1)) > 0, "Cached texture mip levels out of range");
+		uint64_t pixel_count = 0;
+		for (int level = 0; level < texture.mipmaps; ++level)
+			pixel_count += (uint64_t)(texture.width >> level) * (texture.height >> level);
+		check(texture.pixels.size() == pixel_count && texture.indices.size() == pixel_count, "Cached texture pixels out of bounds");
+	}
+	check(data.lightmap.width >= 0 && data.lightmap.height >= 0 && data.lightmap.pixels.size() == (uint64_t)data.lightmap.width * data.lightmap.height,
+		  "Cached lightmap pixels out of bounds");
+
+	const Mesh_Data& mesh = data.mesh;
+	const Packed_Mesh& packed = data.packed_mesh;
+	for (uint32_t index : mesh.indices)
+		check(index < packed.vertices.size(), "Cached index out of bounds");
+	for (const Packed_Vertex& vertex : packed.vertices)
+		check(vertex.surface_id < packed.surfaces.size(), "Cached surface out of bounds");
+	for (const Packed_Surface& surface : packed.surfaces)
+		check(surface.texture_id < data.textures.size(), "Cached surface texture out of bounds");
+
+	auto check_range = [&](const Draw_Range& range) {
+		check((uint64_t)range.first_index + range.index_count <= mesh.indices.size(), "Cached draw range out of bounds");
+		check(range.index_count == 0 || range.texture_id < data.textures.size(), "Cached draw range texture out of bounds");
+	};
+	for (const Draw_Range& range : data.ranges)
+		check_range(range);
+	for (const Map_Model& model : data.models)
+		check((uint64_t)model.first_range + model.range_count <= data.ranges.size(), "Cached model ranges out of bounds");
+	for (const Model_Instance& instance : data.model_instances)
+		check(instance.model_id < data.models.size(), "Cached model instance out of bounds");
+
+	const Map_Tree& tree = data.tree;
+	size_t face_count = tree.face_ranges.size();
+	for (const Draw_Range& range : tree.face_ranges)
+		check_range(range);
+	check(tree.nodes.empty() || (tree.root_node >= 0 && (size_t)tree.root_node < tree.nodes.size()), "Cached root node out of bounds");
+	for (const Node& node : tree.nodes)
+	{
+		check(node.plane_id < tree.planes.size(), "Cached node plane out of bounds");
+		for (int16_t child : {node.front, node.back})
+			check(child >= 0 ? (size_t)child < tree.nodes.size() : (size_t)(uint16_t)~child < tree.leaves.size(), "Cached node child out of bounds");
+		check((size_t)node.face_id + node.face_num <= face_count, "Cached node faces out of bounds");
+	}
+	for (const Leaf& leaf : tree.leaves)
+		check((size_t)leaf.listface_id + leaf.listface_num <= tree.listfaces.size(), "Cached leaf faces out of bounds");
+	for (uint16_t face_id : tree.listfaces)
+		check(face_id < face_count, "Cached leaf face out of bounds");
+
+	check(tree.face_first_vertices.size() == face_count + 1 && tree.face_texinfo_ids.size() == face_count && tree.face_sides.size() == face_count,
+		  "Cached face outlines out of bounds");
+	for (size_t face_id = 0; face_id < face_count; ++face_id)
+		check(tree.face_first_vertices[face_id] <= tree.face_first_vertices[face_id + 1], "Cached face outline out of bounds");
+	check(tree.face_first_vertices.back() <= tree.face_vertices.size(), "Cached face outline out of bounds");
+
+	for (const Hull_Node& node : tree.hull_nodes)
+	{
+		check(node.plane_id < tree.planes.size(), "Cached hull plane out of bounds");
+		for (int32_t child : node.children)
+			check(child < 0 || (size_t)child < tree.hull_nodes.size(), "Cached hull node out of bounds");
+	}
+	for (int32_t root : tree.hull_roots)
+		check(root < 0 || (size_t)root < tree.hull_nodes.size(), "Cached hull root out of bounds");
+}
+
+static Map_Data
+ReadMapData(Cache_Reader& in)
+{
+	Map_Data data{};
+
+	uint64_t texture_count = in.value<uint64_t>();
+	if (texture_count > in.bytes.size())
+		throw std::runtime_error("Truncated map cache");
+	data.textures.resize(texture_count);
+	for (Texture_Data& texture : data.textures)
+	{
+		texture.name = in.string();
+		texture.width = in.value<int>();
+		texture.height = in.value<int>();
+		texture.mipmaps = in.value<int>();
+		in.array(texture.pixels);
+		in.array(texture.indices);
+	}
+
+	Mesh_Data& mesh = data.mesh;
+	in.array(mesh.vertices);
+	in.array(mesh.texcoords);
+	in.array(mesh.lightmap_texcoords);
+	in.array(mesh.normals);
+	in.array(mesh.texture_ids);
+	in.array(mesh.texinfo_ids);
+	in.array(mesh.indices);
+	mesh.soup_vertex_count = in.value<uint64_t>();
+
+	in.array(data.texture_projections);
+	data.packed_mesh.bounds = in.value<BoundingBox>();
+	in.array(data.packed_mesh.vertices);
+	in.array(data.packed_mesh.surfaces);
+	in.array(data.ranges);
+
+	data.lightmap.width = in.value<int>();
+	data.lightmap.height = in.value<int>();
+	in.array(data.lightmap.pixels);
+
+	Map_Tree& tree = data.tree;
+	tree.root_node = in.value<int32_t>();
+	tree.visleaf_count = in.value<int32_t>();
+	in.array(tree.planes);
+	in.array(tree.nodes);
+	in.array(tree.leaves);
+	in.array(tree.listfaces);
+	in.array(tree.visibility);
+	in.array(tree.face_ranges);
+	in.array(tree.face_first_vertices);
+	in.array(tree.face_vertices);
+	in.array(tree.face_texinfo_ids);
+	in.array(tree.face_sides);
+	in.array(tree.hull_nodes);
+	for (int32_t& root : tree.hull_roots)
+		root = in.value<int32_t>();
+
+	in.array(data.models);
+	in.array(data.model_instances);
+	in.array(data.lights);
+
+	if (in.bytes.empty() == false)
+		throw std::runtime_error("Unexpected data at the end of the map cache");
+	CheckMapData(data);
+	return data;
+}
+
+std::filesystem::path
+MapCachePath(const std::filesystem::path& cache_dir, uint64_t source_hash)
+{
+	// Called from load threads, the shared buffer of TextFormat can't be used
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.mapcache", (unsigned long long)source_hash);
+	return cache_dir / name;
+}
+
+void
+SaveMapCache(const std::filesystem::path& path, uint64_t source_hash, const Map_Data& data, bool compress)
+{
+	Cache_Writer payload{};
+	WriteMapData(payload, data);
+	if (payload.bytes.size() > (size_t)std::numeric_limits<int>::max())
+		throw std::runtime_error("Map too large to be cached");
+
+	std::vector<uint8_t> deflated;
+	if (compress)
+	{
+		auto deflate_state = std::make_unique<sdefl>();
+		deflated.resize(sdefl_bound(payload.bytes.size()));
+		deflated.resize(sdeflate(deflate_state.get(), deflated.data(), payload.bytes.data(), payload.bytes.size(), SDEFL_LVL_DEF));
+	}
+	const std::vector<uint8_t>& stored = compress ? deflated : payload.bytes;
+
+	Map_Cache_Header header{
+		.version = MAP_CACHE_VERSION,
+		.source_hash = source_hash,
+		.payload_size = payload.bytes.size(),
+		.stored_size = stored.size(),
+		.compressed = compress,
+	};
+	memcpy(header.magic, MAP_CACHE_MAGIC, sizeof(header.magic));
+
+	// Written aside then renamed, so a reader never sees half a cache
+	std::filesystem::create_directories(path.parent_path());
+	// Loads of one map can overlap, a cancelled one still running beside the next, each writes its own file
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%08x.tmp", (unsigned int)std::random_device{}());
+	std::filesystem::path temporary_path = path;
+	temporary_path += suffix;
+	{
+		std::ofstream file{temporary_path, std::ios::binary | std::ios::trunc};
+		file.write((const char*)&header, sizeof(header));
+		file.write((const char*)stored.data(), stored.size());
+		if (file.good() == false)
+		{
+			file.close();
+			std::error_code error;
+			std::filesystem::remove(temporary_path, error);
+			throw std::runtime_error("Failed to write map cache");
+		}
+	}
+	std::filesystem::rename(temporary_path, path);
+}
+
+std::optional<Map_Data>
+LoadMapCache(const std::filesystem::path& path, uint64_t source_hash)
+{
+	std::error_code error;
+	if (std::filesystem::is_regular_file(path, error) == false)
+		return std::nullopt;
+
+	Mapped_File file{path};
+	Cache_Reader reader{file.bytes};
+	Map_Cache_Header header = reader.value<Map_Cache_Header>();
+	if (memcmp(header.magic, MAP_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.version != MAP_CACHE_VERSION || header.source_hash != source_hash)
+		return std::nullopt;
+	if (header.stored_size != reader.bytes.size() || header.payload_size > (uint64_t)std::numeric_limits<int>::max())
+		throw std::runtime_error("Truncated map cache");
+
+	if (header.compressed == 0)
+		return ReadMapData(reader);
+
+	std::vector<uint8_t> payload(header.payload_size);
+	int inflated = sinflate(payload.data(), payload.size(), reader.bytes.data(), reader.bytes.size());
+	if (inflated < 0 || (uint64_t)inflated != header.payload_size)
+		throw std::runtime_error("Corrupt map cache");
+
+	Cache_Reader payload_reader{payload};
+	return ReadMapData(payload_reader);
+}
+
+std::optional<Map_Data>
+LoadMapDataCached(const std::filesystem::path& path, const std::filesystem::path& cache_dir, std::stop_token stop, std::atomic<float>* progress, bool copy_file)
+{
+	// The bytes hashed are the ones processed, a compiler writing the file meanwhile can't get them mixed up
+	BSP_File map{path, copy_file};
+	uint64_t source_hash = HashBytes(map.file.bytes);
+	std::filesystem::path cache_path = MapCachePath(cache_dir, source_hash);
+
+	// A bad cache is only a missed shortcut, the map is processed again and the cache replaced
+	try
+	{
+		if (std::optional<Map_Data> data = LoadMapCache(cache_path, source_hash))
+		{
+			TraceLog(LOG_INFO, "BSP: Loaded %s from cache", path.string().c_str());
+			if (progress)
+				*progress = 1;
+			return data;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		TraceLog(LOG_WARNING, "BSP: Ignoring map cache %s: %s", cache_path.string().c_str(), e.what());
+	}
+
+	std::optional<Map_Data> data = LoadMapDataFromBSPFile(map, stop, progress);
+	if (data)
+	{
+		try
+		{
+			SaveMapCache(cache_path, source_hash, *data, false);
+		}
+		catch (const std::exception& e)
+		{
+			TraceLog(LOG_WARNING, "BSP: Failed to save map cache %s: %s", cache_path.string().c_str(), e.what());
+		}
+	}
+	return data;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "bsp.h"
+
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <stop_token>
+
+// Bump whenever LoadMapDataFromBSPFile produces something different, caches from other versions are ignored
+constexpr uint32_t MAP_CACHE_VERSION = 9;
+
+uint64_t
+HashBytes(std::span<const uint8_t> bytes);
+
+// Where the cache of a BSP file with the given contents hash goes
+std::filesystem::path
+MapCachePath(const std::filesystem::path& cache_dir, uint64_t source_hash);
+
+// Writes data as it is laid out in memory, deflated when compress is set
+void
+SaveMapCache(const std::filesystem::path& path, uint64_t source_hash, const Map_Data& data, bool compress);
+
+// Nothing when the cache is missing, from another loader version or made from a different BSP file
+std::optional<Map_Data>
+LoadMapCache(const std::filesystem::path& path, uint64_t source_hash);
+
+// LoadMapDataFromBSPFile going through a cache in cache_dir, keyed on the contents of the BSP file.
+// A map seen before is read back without being processed again. copy_file reads the BSP file into
+// memory first, for files a compiler may write again while they load.
+std::optional<Map_Data>
+LoadMapDataCached(const std::filesystem::path& path, const std::filesystem::path& cache_dir, std::stop_token stop = {}, std::atomic<float>* progress = nullptr,
+				  bool copy_file = false);
@@ -0,0 +1,111 @@
+#include "mapped_file.h"
+
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Whatever the file holds by the time it is read, it may be shorter or longer than it was a moment before
+static void
+ReadWholeFile(const std::filesystem::path& path, std::vector<uint8_t>& bytes)
+{
+	std::ifstream file{path, std::ios::binary};
+	std::error_code error;
+	uintmax_t size = std::filesystem::file_size(path, error);
+	if (file.is_open() == false || error)
+		throw std::runtime_error("Failed to open file");
+
+	bytes.resize(size);
+	file.read((char*)bytes.data(), bytes.size());
+	bytes.resize(file.gcount());
+	if (bytes.empty())
+		throw std::runtime_error("Failed to open file");
+}
+
+#ifdef _WIN32
+Mapped_File::Mapped_File(const std::filesystem::path& path, bool copy)
+{
+	if (copy)
+	{
+		ReadWholeFile(path, copied);
+		bytes = copied;
+		return;
+	}
+
+	file_handle = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_handle == INVALID_HANDLE_VALUE)
+		throw std::runtime_error("Failed to open file");
+
+	LARGE_INTEGER size{};
+	if (GetFileSizeEx(file_handle, &size) == false || size.QuadPart == 0)
+	{
+		CloseHandle(file_handle);
+		throw std::runtime_error("Failed to open file");
+	}
+
+	mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	const void* data = mapping_handle ? MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+	if (data == nullptr)
+	{
+		if (mapping_handle)
+			CloseHandle(mapping_handle);
+		CloseHandle(file_handle);
+		throw std::runtime_error("Failed to map file");
+	}
+
+	bytes = {(const uint8_t*)data, (size_t)size.QuadPart};
+}
+
+Mapped_File::~Mapped_File()
+{
+	if (copied.empty() == false)
+		return;
+	UnmapViewOfFile(bytes.data());
+	CloseHandle(mapping_handle);
+	CloseHandle(file_handle);
+}
+#else
+Mapped_File::Mapped_File(const std::filesystem::path& path, bool copy)
+{
+	if (copy)
+	{
+		ReadWholeFile(path, copied);
+		bytes = copied;
+		return;
+	}
+
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw std::runtime_error("Failed to open file");
+
+	struct stat st{};
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		throw std::runtime_error("Failed to open file");
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps its own reference to the file
+	if (data == MAP_FAILED)
+		throw std::runtime_error("Failed to map file");
+
+	bytes = {(const uint8_t*)data, (size_t)st.st_size};
+}
+
+Mapped_File::~Mapped_File()
+{
+	if (copied.empty() == false)
+		return;
+	munmap((void*)bytes.data(), bytes.size());
+}
+#endif
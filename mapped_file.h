@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+// Read-only view of a whole file, mapped into memory once.
+// Kept apart from raylib headers, windows.h clashes with them.
+struct Mapped_File
+{
+	std::span<const uint8_t> bytes;
+
+	// Files another program may still be writing are read into memory instead, reading a mapping
+	// past the end of a file cut short while it is in use is a bus error rather than an exception
+	Mapped_File(const std::filesystem::path& path, bool copy = false);
+	~Mapped_File();
+
+	Mapped_File(const Mapped_File&) = delete;
+	Mapped_File&
+	operator=(const Mapped_File&) = delete;
+
+private:
+	std::vector<uint8_t> copied; // Holds the bytes when the file was read rather than mapped
+#ifdef _WIN32
+	void* file_handle = nullptr;
+	void* mapping_handle = nullptr;
+#endif
+};
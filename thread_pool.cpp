@@ -0,0 +1,44 @@
+#include "thread_pool.h"
+
+Thread_Pool::Thread_Pool(size_t worker_count)
+{
+	for (size_t i = 0; i < worker_count; ++i)
+	{
+		workers.emplace_back([this] {
+			while (true)
+			{
+				std::function<void()> job;
+				{
+					std::unique_lock lock{mutex};
+					jobs_available.wait(lock, [this] { return stopping || jobs.empty() == false; });
+					if (jobs.empty())
+						return;
+
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job();
+			}
+		});
+	}
+}
+
+Thread_Pool::~Thread_Pool()
+{
+	{
+		std::scoped_lock lock{mutex};
+		stopping = true;
+	}
+	jobs_available.notify_all();
+
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+Thread_Pool&
+DefaultThreadPool()
+{
+	// The calling thread always takes part, so one worker fewer than there are cores
+	static Thread_Pool pool{std::max(std::thread::hardware_concurrency(), 2u) - 1};
+	return pool;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads shared by everything that wants to fan out CPU work
+struct Thread_Pool
+{
+	Thread_Pool(size_t worker_count = std::thread::hardware_concurrency());
+	~Thread_Pool();
+
+	Thread_Pool(const Thread_Pool&) = delete;
+	Thread_Pool&
+	operator=(const Thread_Pool&) = delete;
+
+	size_t
+	size() const
+	{
+		return workers.size();
+	}
+
+	// Calls fn(i) for every i in [0, count), the calling thread takes part too.
+	// Returns once every call is done, rethrowing the first exception thrown.
+	template<typename F>
+	void
+	parallel_for(size_t count, F&& fn)
+	{
+		// Helpers may still be finishing up after the last index completes, so their state is shared
+		struct Loop
+		{
+			std::atomic<size_t> next = 0;
+			std::atomic<size_t> helpers_running = 0;
+			std::exception_ptr error;
+			std::mutex error_mutex;
+		};
+		auto loop = std::make_shared<Loop>();
+
+		auto run = [count, &fn](Loop& loop) {
+			for (size_t i = loop.next++; i < count; i = loop.next++)
+			{
+				try
+				{
+					fn(i);
+				}
+				catch (...)
+				{
+					std::scoped_lock lock{loop.error_mutex};
+					if (loop.error == nullptr)
+						loop.error = std::current_exception();
+				}
+			}
+		};
+
+		size_t helpers = std::min(workers.size(), count > 0 ? count - 1 : 0);
+		if (helpers > 0)
+		{
+			loop->helpers_running = helpers;
+			{
+				std::scoped_lock lock{mutex};
+				for (size_t i = 0; i < helpers; ++i)
+				{
+					jobs.push_back([loop, &run] {
+						run(*loop);
+						if (--loop->helpers_running == 0)
+							loop->helpers_running.notify_all();
+					});
+				}
+			}
+			jobs_available.notify_all();
+		}
+
+		run(*loop);
+
+		// Helpers reference fn, wait for all of them even if they found no work left
+		for (size_t running = loop->helpers_running; running != 0; running = loop->helpers_running)
+			loop->helpers_running.wait(running);
+
+		if (loop->error)
+			std::rethrow_exception(loop->error);
+	}
+
+private:
+	std::mutex mutex;
+	std::condition_variable jobs_available;
+	std::deque<std::function<void()>> jobs;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+};
+
+Thread_Pool&
+DefaultThreadPool();
@@ -0,0 +1,339 @@
+// Times each stage of the BSP loader on its own, optionally checking the results against a baseline
+
+#include <raylib.h>
+
+#include "bsp.h"
+#include "bsp_file.h"
+#include "map_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every allocation made through operator new, from any thread
+static std::atomic<size_t> allocation_count = 0;
+
+void*
+operator new(size_t size)
+{
+	++allocation_count;
+	if (void* ptr = malloc(size != 0 ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void
+operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
+void
+operator delete(void* ptr, size_t) noexcept
+{
+	free(ptr);
+}
+
+// Results go here so the work producing them is not optimized away
+static volatile size_t sink = 0;
+
+struct Stage_Result
+{
+	std::string map;
+	std::string stage;
+	double min_ms, median_ms, p99_ms;
+	size_t allocations; // Per run
+};
+
+static Stage_Result
+Measure(const std::string& map, const std::string& stage, int iterations, const std::function<size_t()>& fn)
+{
+	std::vector<double> times;
+	size_t allocations = 0;
+	for (int i = 0; i < iterations; ++i)
+	{
+		size_t allocationsBefore = allocation_count;
+		auto start = std::chrono::steady_clock::now();
+		sink = sink + fn();
+		auto end = std::chrono::steady_clock::now();
+		allocations = allocation_count - allocationsBefore;
+		times.push_back(std::chrono::duration<double, std::milli>(end - start).count());
+	}
+
+	std::sort(times.begin(), times.end());
+	size_t p99 = std::min(times.size() - 1, (size_t)std::ceil(0.99 * times.size()) - 1);
+	return {
+		.map = map,
+		.stage = stage,
+		.min_ms = times.front(),
+		.median_ms = times[times.size() / 2],
+		.p99_ms = times[p99],
+		.allocations = allocations,
+	};
+}
+
+static std::vector<Stage_Result>
+BenchmarkMap(const std::filesystem::path& path, int iterations)
+{
+	std::string name = path.filename().string();
+	std::vector<Stage_Result> results;
+
+	// Inputs of each stage come from running the previous ones once, outside of the measurements
+	BSP_File map{path};
+	Map_Arrays arrays = DecodeMapArrays(map);
+	std::set<size_t> leaves = CollectWorldLeaves(map);
+	Entity_List entities = map.entities();
+	std::vector<Model_Instance> instances = FindModelInstances(map, entities);
+	Texture_Groups groups = GroupFacesByTexture(map, arrays, leaves, instances);
+	std::vector<uint32_t> drawnFaces;
+	for (const std::vector<uint32_t>& faceList : groups.face_lists)
+		drawnFaces.insert(drawnFaces.end(), faceList.begin(), faceList.end());
+	std::vector<Face_Lightmap> faceLightmaps;
+	Lightmap_Data lightmap = PackLightmaps(arrays, map.lightmaps, drawnFaces, faceLightmaps);
+
+	results.push_back(Measure(name, "open", iterations, [&] {
+		BSP_File file{path};
+		return file.faces.size();
+	}));
+	results.push_back(Measure(name, "decode", iterations, [&] { return DecodeMapArrays(map).face_vertices.size(); }));
+	results.push_back(Measure(name, "entities", iterations, [&] { return map.entities().size(); }));
+	results.push_back(Measure(name, "traversal", iterations, [&] { return CollectWorldLeaves(map).size(); }));
+	results.push_back(Measure(name, "hulls", iterations, [&] {
+		Map_Tree tree;
+		BuildHulls(map, tree);
+		return tree.hull_nodes.size();
+	}));
+	results.push_back(Measure(name, "grouping", iterations, [&] { return GroupFacesByTexture(map, arrays, leaves, instances).face_lists.size(); }));
+	results.push_back(Measure(name, "lightmaps", iterations, [&] {
+		std::vector<Face_Lightmap> packed;
+		return PackLightmaps(arrays, map.lightmaps, drawnFaces, packed).pixels.size();
+	}));
+	results.push_back(Measure(name, "meshing", iterations, [&] {
+		size_t indices = 0;
+		std::vector<Draw_Range> faceRanges;
+		for (size_t i = 0; i < groups.face_lists.size(); ++i)
+			indices += GenMeshFaces(arrays, groups.face_lists[i], groups.texture_ids[i], faceLightmaps, lightmap, faceRanges).indices.size();
+		return indices;
+	}));
+	results.push_back(Measure(name, "palette", iterations, [&] {
+		size_t pixels = 0;
+		for (uint32_t miptexId : groups.miptex_ids)
+			pixels += DecodeTexture(map, miptexId).pixels.size();
+		return pixels;
+	}));
+	results.push_back(Measure(name, "load", iterations, [&] { return LoadMapDataFromBSPFile(path)->mesh.indices.size(); }));
+
+	Map_Data data = *LoadMapDataFromBSPFile(path);
+	results.push_back(Measure(name, "packing", iterations, [&] { return PackMesh(data.mesh, data.texture_projections).vertices.size(); }));
+
+	std::filesystem::path cachePath = std::filesystem::temp_directory_path() / ("bsp-benchmark-" + name + ".mapcache");
+	SaveMapCache(cachePath, 0, data, false);
+	results.push_back(Measure(name, "cache_read", iterations, [&] { return LoadMapCache(cachePath, 0)->mesh.indices.size(); }));
+	std::filesystem::remove(cachePath);
+
+	return results;
+}
+
+static std::string
+JsonString(const std::string& value)
+{
+	std::string out = "\"";
+	for (char c : value)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+// One result per line, ReadBaseline relies on it
+static void
+WriteJson(const std::filesystem::path& path, int iterations, const std::vector<Stage_Result>& results)
+{
+	std::ofstream file{path};
+	file << "{\n\t\"iterations\": " << iterations << ",\n\t\"results\": [\n";
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const Stage_Result& result = results[i];
+		file << TextFormat("\t\t{\"map\": %s, \"stage\": %s, \"min_ms\": %.4f, \"median_ms\": %.4f, \"p99_ms\": %.4f, \"allocations\": %zu}%s\n",
+						   JsonString(result.map).c_str(), JsonString(result.stage).c_str(), result.min_ms, result.median_ms, result.p99_ms,
+						   result.allocations, i + 1 < results.size() ? "," : "");
+	}
+	file << "\t]\n}\n";
+	if (file.good() == false)
+		throw std::runtime_error("Failed to write " + path.string());
+}
+
+// Value following "key": on a line, without quotes for strings
+static std::string_view
+JsonField(std::string_view line, std::string_view key)
+{
+	std::string quotedKey = "\"" + std::string(key) + "\":";
+	size_t start = line.find(quotedKey);
+	if (start == std::string_view::npos)
+		return {};
+
+	start = line.find_first_not_of(' ', start + quotedKey.size());
+	if (start == std::string_view::npos)
+		return {};
+	if (line[start] == '"')
+	{
+		size_t end = line.find('"', start + 1);
+		return line.substr(start + 1, end - start - 1);
+	}
+	size_t end = line.find_first_of(",}", start);
+	return line.substr(start, end - start);
+}
+
+// Median times of a file written by --json, keyed by map then stage
+static std::map<std::pair<std::string, std::string>, double>
+ReadBaseline(const std::filesystem::path& path)
+{
+	std::ifstream file{path};
+	if (file.is_open() == false)
+		throw std::runtime_error("Failed to open baseline " + path.string());
+
+	std::map<std::pair<std::string, std::string>, double> medians;
+	for (std::string line; std::getline(file, line);)
+	{
+		std::string_view map = JsonField(line, "map"), stage = JsonField(line, "stage"), median = JsonField(line, "median_ms");
+		if (map.empty() || stage.empty() || median.empty())
+			continue;
+		medians[{std::string(map), std::string(stage)}] = std::strtod(std::string(median).c_str(), nullptr);
+	}
+	return medians;
+}
+
+static int
+Usage()
+{
+	fprintf(stderr,
+			"usage: bsp-benchmark [-n iterations] [--json out.json] [--baseline in.json] [--threshold fraction] [map.bsp | dir]...\n"
+			"\n"
+			"Times each loader stage on the given maps, every .bsp in a directory, or dm4 by default.\n"
+			"With a baseline, exits with 1 when a median is slower than its baseline by more than the threshold (0.25).\n");
+	return 2;
+}
+
+int
+main(int argc, char** argv)
+{
+	int iterations = 50;
+	std::filesystem::path jsonPath, baselinePath;
+	double threshold = 0.25;
+	std::vector<std::filesystem::path> inputs;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "-n" && hasValue)
+			iterations = std::max(1, atoi(argv[++i]));
+		else if (arg == "--json" && hasValue)
+			jsonPath = argv[++i];
+		else if (arg == "--baseline" && hasValue)
+			baselinePath = argv[++i];
+		else if (arg == "--threshold" && hasValue)
+			threshold = atof(argv[++i]);
+		else if (arg.starts_with("-"))
+			return Usage();
+		else
+			inputs.push_back(arg);
+	}
+	if (inputs.empty())
+		inputs.push_back(MAP_SOURCE_DIR "/bsp/dm4.bsp");
+
+	std::vector<std::filesystem::path> maps;
+	for (const std::filesystem::path& input : inputs)
+	{
+		if (std::filesystem::is_directory(input) == false)
+		{
+			maps.push_back(input);
+			continue;
+		}
+		for (const auto& entry : std::filesystem::directory_iterator(input))
+		{
+			std::string extension = entry.path().extension().string();
+			std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+			if (entry.is_regular_file() && extension == ".bsp")
+				maps.push_back(entry.path());
+		}
+	}
+	std::sort(maps.begin(), maps.end());
+
+	SetTraceLogLevel(LOG_WARNING);
+	std::vector<Stage_Result> results;
+	int failures = 0;
+	for (const std::filesystem::path& path : maps)
+	{
+		try
+		{
+			std::vector<Stage_Result> mapResults = BenchmarkMap(path, iterations);
+			printf("%s, %d iterations\n", path.string().c_str(), iterations);
+			printf("  %-12s %10s %10s %10s %12s\n", "stage", "min ms", "median ms", "p99 ms", "allocations");
+			for (const Stage_Result& result : mapResults)
+				printf("  %-12s %10.3f %10.3f %10.3f %12zu\n", result.stage.c_str(), result.min_ms, result.median_ms, result.p99_ms, result.allocations);
+			results.insert(results.end(), mapResults.begin(), mapResults.end());
+		}
+		catch (const std::exception& e)
+		{
+			fprintf(stderr, "%s: %s\n", path.string().c_str(), e.what());
+			++failures;
+		}
+		catch (const char* e)
+		{
+			fprintf(stderr, "%s: %s\n", path.string().c_str(), e);
+			++failures;
+		}
+	}
+
+	try
+	{
+		if (jsonPath.empty() == false)
+			WriteJson(jsonPath, iterations, results);
+
+		if (baselinePath.empty() == false)
+		{
+			// Stages taking a few microseconds are too noisy to compare relatively
+			const double MIN_REGRESSION_MS = 0.05;
+
+			auto baseline = ReadBaseline(baselinePath);
+			for (const Stage_Result& result : results)
+			{
+				auto it = baseline.find({result.map, result.stage});
+				if (it == baseline.end())
+					continue;
+
+				double limit = it->second * (1 + threshold);
+				if (result.median_ms > limit && result.median_ms - it->second > MIN_REGRESSION_MS)
+				{
+					printf("REGRESSION %s %s: median %.3f ms, baseline %.3f ms\n", result.map.c_str(), result.stage.c_str(), result.median_ms, it->second);
+					++failures;
+				}
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s\n", e.what());
+		++failures;
+	}
+
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,405 @@
+// Writes synthetic v29 BSP files of a chosen size, to see how the loader and culling scale.
+// The map is a floor made of a grid of square faces, split into blocks of cells by a kd-tree.
+// Each block is an empty leaf above the floor and the solid leaf below it.
+
+#include <raylib.h>
+
+#include "bsp.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+// The format stores face, vertex and node indices as 16 bits, a 255x255 grid has as many corners as fit
+constexpr size_t MAX_FACES = 255 * 255;
+constexpr size_t MAX_NODES = 32767;
+
+constexpr int CELL_SIZE = 64;    // Units covered by one face, 5x5 luxels
+constexpr int TEXTURE_SIZE = 64; // Every texture is square
+constexpr int ROOM_HEIGHT = 256; // Top of the empty leaves
+
+struct Generator_Options
+{
+	size_t faces = 4096;
+	size_t leaves = 256;
+	size_t textures = 8;
+	size_t entity_bytes = 4096;
+	float pvs_density = 0.25f; // Chance for a leaf to see any other
+	uint32_t seed = 1;
+};
+
+struct Generator
+{
+	Generator_Options options;
+	int grid_width, grid_height; // In cells
+	std::mt19937 random;
+
+	std::vector<Plane> planes;
+	std::map<std::pair<int, int>, uint32_t> axial_planes; // Plane type and distance to index
+	std::vector<Vector3> vertices;
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+	std::vector<Face> faces;
+	std::vector<uint16_t> listfaces;
+	std::vector<Edge> edges;
+	std::vector<int32_t> listedges;
+	std::vector<TexInfo> texinfos;
+	std::vector<uint8_t> lightmaps;
+	std::vector<uint8_t> visibility;
+	std::vector<Clipnode> clipnodes;
+
+	uint32_t
+	axial_plane(int type, int dist)
+	{
+		auto [it, inserted] = axial_planes.try_emplace({type, dist}, planes.size());
+		if (inserted)
+		{
+			Vector3 normal = {type == 0 ? 1.f : 0.f, type == 1 ? 1.f : 0.f, type == 2 ? 1.f : 0.f};
+			planes.push_back({.normal = normal, .dist = (float)dist, .type = type});
+		}
+		return it->second;
+	}
+
+	uint16_t
+	grid_vertex(int x, int y)
+	{
+		return y * (grid_width + 1) + x;
+	}
+
+	void
+	add_face(int x, int y)
+	{
+		// Quake faces wind clockwise seen from the front, here from above
+		uint16_t corners[4] = {grid_vertex(x, y), grid_vertex(x, y + 1), grid_vertex(x + 1, y + 1), grid_vertex(x + 1, y)};
+		int32_t ledge_id = listedges.size();
+		for (int i = 0; i < 4; ++i)
+		{
+			listedges.push_back(edges.size());
+			edges.push_back({corners[i], corners[(i + 1) % 4]});
+		}
+
+		uint32_t texinfo_id = (x * 7 + y * 13) % texinfos.size();
+		int32_t lightmap = lightmaps.size();
+		for (int t = 0; t < 5; ++t)
+		{
+			for (int s = 0; s < 5; ++s)
+			{
+				// Soft pools of light over the floor
+				float luxel_x = x * 4 + s, luxel_y = y * 4 + t;
+				float light = 0.5f + 0.25f * (std::sin(luxel_x * 0.15f) + std::cos(luxel_y * 0.11f));
+				lightmaps.push_back(uint8_t(40 + 180 * light));
+			}
+		}
+
+		faces.push_back({
+			.plane_id = (uint16_t)axial_plane(2, 0),
+			.side = 0,
+			.ledge_id = ledge_id,
+			.ledge_num = 4,
+			.texinfo_id = (uint16_t)texinfo_id,
+			.typelight = 0,
+			.baselight = 255,
+			.light = {255, 255},
+			.lightmap = lightmap,
+		});
+	}
+
+	static BoundingBoxS
+	block_box(int x0, int y0, int x1, int y1, int z0, int z1)
+	{
+		return {
+			.min = {int16_t(x0 * CELL_SIZE), int16_t(y0 * CELL_SIZE), int16_t(z0)},
+			.max = {int16_t(x1 * CELL_SIZE), int16_t(y1 * CELL_SIZE), int16_t(z1)},
+		};
+	}
+
+	// Returns the child index of the subtree covering cells [x0, x1) x [y0, y1), split into leaf_count leaves
+	int16_t
+	build_tree(int x0, int y0, int x1, int y1, size_t leaf_count)
+	{
+		int16_t node_id = nodes.size();
+		nodes.emplace_back();
+
+		bool can_split_x = x1 - x0 > 1, can_split_y = y1 - y0 > 1;
+		if (leaf_count > 1 && (can_split_x || can_split_y))
+		{
+			// Split the longest side, in proportion to the leaves each half gets
+			bool split_x = can_split_x && (x1 - x0 >= y1 - y0 || can_split_y == false);
+			int lo = split_x ? x0 : y0, hi = split_x ? x1 : y1;
+			size_t back_leaves = leaf_count / 2;
+			int split = std::clamp(lo + int((hi - lo) * back_leaves / leaf_count), lo + 1, hi - 1);
+
+			int16_t back = split_x ? build_tree(x0, y0, split, y1, back_leaves) : build_tree(x0, y0, x1, split, back_leaves);
+			int16_t front = split_x ? build_tree(split, y0, x1, y1, leaf_count - back_leaves) : build_tree(x0, split, x1, y1, leaf_count - back_leaves);
+			nodes[node_id] = {
+				.plane_id = axial_plane(split_x ? 0 : 1, split * CELL_SIZE),
+				.front = front,
+				.back = back,
+				.box = block_box(x0, y0, x1, y1, -CELL_SIZE, ROOM_HEIGHT),
+			};
+			return node_id;
+		}
+
+		// A block of the floor, its faces lie on the node plane with the room in front and solid behind
+		uint16_t face_id = faces.size();
+		for (int y = y0; y < y1; ++y)
+			for (int x = x0; x < x1; ++x)
+				add_face(x, y);
+		uint16_t face_num = faces.size() - face_id;
+
+		int16_t leaf_id = leaves.size();
+		uint16_t listface_id = listfaces.size();
+		for (uint16_t i = 0; i < face_num; ++i)
+			listfaces.push_back(face_id + i);
+		leaves.push_back({
+			.type = CONTENTS_EMPTY,
+			.visibility_id = -1,
+			.bound = block_box(x0, y0, x1, y1, 0, ROOM_HEIGHT),
+			.listface_id = listface_id,
+			.listface_num = face_num,
+		});
+
+		nodes[node_id] = {
+			.plane_id = axial_plane(2, 0),
+			.front = int16_t(~leaf_id),
+			.back = int16_t(~0),
+			.box = block_box(x0, y0, x1, y1, -CELL_SIZE, ROOM_HEIGHT),
+			.face_id = face_id,
+			.face_num = face_num,
+		};
+		return node_id;
+	}
+
+	// A zero byte followed by how many zero bytes it stands for, like the vis tool writes them
+	void
+	compress_vis(const std::vector<uint8_t>& row)
+	{
+		for (size_t i = 0; i < row.size(); ++i)
+		{
+			visibility.push_back(row[i]);
+			if (row[i] != 0)
+				continue;
+
+			uint8_t run = 1;
+			while (i + 1 < row.size() && row[i + 1] == 0 && run < 255)
+			{
+				++run;
+				++i;
+			}
+			visibility.push_back(run);
+		}
+	}
+
+	void
+	build_vis()
+	{
+		std::bernoulli_distribution sees{options.pvs_density};
+		size_t visleaf_count = leaves.size() - 1;
+		std::vector<uint8_t> row((visleaf_count + 7) / 8);
+		for (size_t leaf_id = 1; leaf_id < leaves.size(); ++leaf_id)
+		{
+			std::fill(row.begin(), row.end(), 0);
+			for (size_t other = 1; other < leaves.size(); ++other)
+				if (other == leaf_id || sees(random))
+					row[(other - 1) / 8] |= 1 << ((other - 1) % 8);
+
+			leaves[leaf_id].visibility_id = visibility.size();
+			compress_vis(row);
+		}
+	}
+
+	std::vector<uint8_t>
+	build_miptex()
+	{
+		std::vector<uint8_t> lump(sizeof(int32_t) * (1 + options.textures));
+		int32_t count = options.textures;
+		memcpy(lump.data(), &count, sizeof(count));
+
+		for (size_t i = 0; i < options.textures; ++i)
+		{
+			int32_t offset = lump.size();
+			memcpy(lump.data() + sizeof(int32_t) * (1 + i), &offset, sizeof(offset));
+
+			Miptex miptex{.width = TEXTURE_SIZE, .height = TEXTURE_SIZE};
+			snprintf(miptex.name, sizeof(miptex.name), "synth%u", (uint32_t)i); // There are at most MAX_FACES textures, the number always fits
+			uint32_t level_offset = sizeof(Miptex);
+			for (int level = 0; level < MIPLEVELS; ++level)
+			{
+				miptex.offset[level] = level_offset;
+				level_offset += (TEXTURE_SIZE >> level) * (TEXTURE_SIZE >> level);
+			}
+			lump.resize(offset + sizeof(Miptex));
+			memcpy(lump.data() + offset, &miptex, sizeof(Miptex));
+
+			// A checkerboard in two shades of one of the palette ramps
+			uint8_t ramp = 16 * (1 + i % 13);
+			for (int level = 0; level < MIPLEVELS; ++level)
+			{
+				int size = TEXTURE_SIZE >> level;
+				for (int y = 0; y < size; ++y)
+					for (int x = 0; x < size; ++x)
+						lump.push_back(ramp + ((((x << level) / 8 + (y << level) / 8) % 2) != 0 ? 4 : 10));
+			}
+		}
+		return lump;
+	}
+
+	std::string
+	build_entities()
+	{
+		float center_x = grid_width * CELL_SIZE / 2.f, center_y = grid_height * CELL_SIZE / 2.f;
+		std::string text = "{\n\"classname\" \"worldspawn\"\n\"message\" \"Synthetic map\"\n}\n";
+		text += TextFormat("{\n\"classname\" \"info_player_start\"\n\"origin\" \"%.0f %.0f 48\"\n\"angle\" \"0\"\n}\n", center_x, center_y);
+
+		// Lights scattered over the floor until the lump is as large as asked
+		std::uniform_real_distribution<float> x_position{0, float(grid_width * CELL_SIZE)};
+		std::uniform_real_distribution<float> y_position{0, float(grid_height * CELL_SIZE)};
+		while (text.size() < options.entity_bytes)
+			text += TextFormat("{\n\"classname\" \"light\"\n\"origin\" \"%.0f %.0f 128\"\n\"light\" \"300\"\n}\n", x_position(random), y_position(random));
+
+		return text;
+	}
+
+	std::vector<uint8_t>
+	generate()
+	{
+		random.seed(options.seed);
+
+		// The grid shares its corners, which keeps vertices under the limit along with the faces
+		grid_width = std::max(1, (int)std::ceil(std::sqrt((double)options.faces)));
+		grid_height = std::max<int>(1, (options.faces + grid_width - 1) / grid_width);
+		for (int y = 0; y <= grid_height; ++y)
+			for (int x = 0; x <= grid_width; ++x)
+				vertices.push_back({float(x * CELL_SIZE), float(y * CELL_SIZE), 0});
+
+		for (size_t i = 0; i < options.textures; ++i)
+			texinfos.push_back({.u_axis = {1, 0, 0}, .v_axis = {0, 1, 0}, .miptex_id = (uint32_t)i});
+
+		edges.push_back({}); // Edge 0 cannot be referenced backwards, the compilers leave it unused
+		leaves.push_back({.type = CONTENTS_SOLID, .visibility_id = -1});
+		build_tree(0, 0, grid_width, grid_height, options.leaves);
+		build_vis();
+
+		// Player sized hulls only need the floor, raised by how far the hull reaches below its origin
+		for (int hull = 1; hull <= 2; ++hull)
+			clipnodes.push_back({.planenum = axial_plane(2, 24), .front = -1, .back = -2});
+
+		BSP_Model world{
+			.bound = {{0, 0, -CELL_SIZE}, {float(grid_width * CELL_SIZE), float(grid_height * CELL_SIZE), ROOM_HEIGHT}},
+			.origin = {},
+			.bsp_node_id = 0,
+			.clipnode1_id = 0,
+			.clipnode2_id = 1,
+			.numleafs = int32_t(leaves.size() - 1),
+			.face_id = 0,
+			.face_num = int32_t(faces.size()),
+		};
+
+		std::vector<uint8_t> file(sizeof(Header));
+		auto append_lump = [&file](const void* data, size_t size) {
+			file.resize((file.size() + 3) & ~size_t(3));
+			Dir_Entry entry{.offset = (int32_t)file.size(), .size = (int32_t)size};
+			file.insert(file.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+			return entry;
+		};
+		auto append_vector = [&append_lump](const auto& values) { return append_lump(values.data(), values.size() * sizeof(values[0])); };
+
+		std::string entities = build_entities();
+		std::vector<uint8_t> miptex = build_miptex();
+
+		Header header{.version = 29};
+		header.entities = append_lump(entities.c_str(), entities.size() + 1);
+		header.planes = append_vector(planes);
+		header.miptex = append_vector(miptex);
+		header.vertices = append_vector(vertices);
+		header.visibility = append_vector(visibility);
+		header.nodes = append_vector(nodes);
+		header.texinfos = append_vector(texinfos);
+		header.faces = append_vector(faces);
+		header.lightmaps = append_vector(lightmaps);
+		header.clipnodes = append_vector(clipnodes);
+		header.leaves = append_vector(leaves);
+		header.listfaces = append_vector(listfaces);
+		header.edges = append_vector(edges);
+		header.listedges = append_vector(listedges);
+		header.models = append_lump(&world, sizeof(world));
+		memcpy(file.data(), &header, sizeof(header));
+		return file;
+	}
+};
+
+static int
+Usage()
+{
+	fprintf(stderr,
+			"usage: bsp-generator [options] -o out.bsp\n"
+			"\n"
+			"  --faces N          Floor faces, up to %zu (4096)\n"
+			"  --leaves N         Empty leaves the floor is split into (256)\n"
+			"  --textures N       Distinct textures (8)\n"
+			"  --entity-bytes N   Size of the entity lump, filled with lights (4096)\n"
+			"  --pvs-density F    Chance for a leaf to see any other, 0 to 1 (0.25)\n"
+			"  --seed N           Seed of the random choices (1)\n",
+			MAX_FACES);
+	return 2;
+}
+
+int
+main(int argc, char** argv)
+{
+	Generator_Options options{};
+	std::string outputPath;
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (i + 1 == argc)
+			return Usage();
+
+		const char* value = argv[++i];
+		if (arg == "-o")
+			outputPath = value;
+		else if (arg == "--faces")
+			options.faces = strtoull(value, nullptr, 10);
+		else if (arg == "--leaves")
+			options.leaves = strtoull(value, nullptr, 10);
+		else if (arg == "--textures")
+			options.textures = strtoull(value, nullptr, 10);
+		else if (arg == "--entity-bytes")
+			options.entity_bytes = strtoull(value, nullptr, 10);
+		else if (arg == "--pvs-density")
+			options.pvs_density = std::clamp((float)atof(value), 0.f, 1.f);
+		else if (arg == "--seed")
+			options.seed = strtoul(value, nullptr, 10);
+		else
+			return Usage();
+	}
+	if (outputPath.empty())
+		return Usage();
+
+	// Every leaf takes at least one face and two nodes, one to split and one to hold its faces
+	options.faces = std::clamp<size_t>(options.faces, 1, MAX_FACES);
+	options.leaves = std::clamp<size_t>(options.leaves, 1, std::min(options.faces, (MAX_NODES + 1) / 2));
+	options.textures = std::clamp<size_t>(options.textures, 1, options.faces);
+
+	Generator generator{.options = options};
+	std::vector<uint8_t> bytes = generator.generate();
+
+	std::ofstream file{outputPath, std::ios::binary | std::ios::trunc};
+	file.write((const char*)bytes.data(), bytes.size());
+	if (file.good() == false)
+	{
+		fprintf(stderr, "Failed to write %s\n", outputPath.c_str());
+		return 1;
+	}
+
+	printf("%s: %zu faces, %zu leaves, %zu nodes, %zu textures, %zu KiB\n", outputPath.c_str(), generator.faces.size(), generator.leaves.size() - 1,
+		   generator.nodes.size(), options.textures, bytes.size() / 1024);
+	return 0;
+}
@@ -0,0 +1,133 @@
+// Compares the palette decode kernels on every mip level of the textures of a map, in pixels per second
+
+#include <raylib.h>
+
+#include "bsp.h"
+#include "bsp_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <string.h>
+
+// Results go here so the work producing them is not optimized away
+static volatile uint8_t sink = 0;
+
+// Median time of one decode of every index
+static double
+MedianSeconds(int iterations, const std::function<void()>& fn)
+{
+	std::vector<double> times;
+	for (int i = 0; i < iterations; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		auto end = std::chrono::steady_clock::now();
+		times.push_back(std::chrono::duration<double>(end - start).count());
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+static int
+Usage()
+{
+	fprintf(stderr, "usage: palette-benchmark [-n iterations] [map.bsp]\n");
+	return 2;
+}
+
+int
+main(int argc, char** argv)
+{
+	int iterations = 200;
+	std::filesystem::path path = MAP_SOURCE_DIR "/bsp/dm4.bsp";
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		if (arg == "-n" && i + 1 < argc)
+			iterations = std::max(1, atoi(argv[++i]));
+		else if (arg.starts_with("-"))
+			return Usage();
+		else
+			path = arg;
+	}
+
+	SetTraceLogLevel(LOG_WARNING);
+	std::vector<uint8_t> indices;
+	try
+	{
+		BSP_File map{path};
+		for (int32_t miptexId = 0; miptexId < map.miptex_count(); ++miptexId)
+		{
+			if (map.miptex_offsets[miptexId] == -1)
+				continue;
+			for (uint8_t miplevel = 0; miplevel < MIPLEVELS; ++miplevel)
+			{
+				std::span<const uint8_t> level = map.miptex_pixels(miptexId, miplevel);
+				indices.insert(indices.end(), level.begin(), level.end());
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s: %s\n", path.string().c_str(), e.what());
+		return 1;
+	}
+	if (indices.empty())
+	{
+		fprintf(stderr, "%s: no textures\n", path.string().c_str());
+		return 1;
+	}
+
+	// The path textures took before the kernels, growing a vector one pixel at a time
+	std::vector<Color_RGB8> expected;
+	double transformSeconds = MedianSeconds(iterations, [&] {
+		std::vector<Color_RGB8> colors;
+		std::transform(indices.begin(), indices.end(), std::back_inserter(colors), palette);
+		sink = sink + colors.back().r;
+		expected = std::move(colors);
+	});
+
+	struct Kernel
+	{
+		const char* name;
+		void (*fn)(std::span<const uint8_t>, Color_RGB8*);
+	};
+	std::vector<Kernel> kernels{{"scalar", DecodePaletteScalar}};
+	if (HasPaletteAVX2())
+		kernels.push_back({"avx2", DecodePaletteAVX2});
+	kernels.push_back({"dispatch", DecodePalette});
+
+	printf("%s, %zu pixels, %d iterations\n", path.string().c_str(), indices.size(), iterations);
+	printf("  %-10s %12s %10s\n", "kernel", "Mpixels/s", "speedup");
+	printf("  %-10s %12.1f %10.2f\n", "transform", indices.size() / transformSeconds / 1e6, 1.0);
+
+	int failures = 0;
+	std::vector<Color_RGB8> colors(indices.size());
+	for (const Kernel& kernel : kernels)
+	{
+		double seconds = MedianSeconds(iterations, [&] {
+			kernel.fn(indices, colors.data());
+			sink = sink + colors.back().r;
+		});
+		printf("  %-10s %12.1f %10.2f\n", kernel.name, indices.size() / seconds / 1e6, transformSeconds / seconds);
+
+		if (memcmp(colors.data(), expected.data(), colors.size() * sizeof(Color_RGB8)) != 0)
+		{
+			printf("MISMATCH %s differs from the palette\n", kernel.name);
+			++failures;
+		}
+	}
+	if (HasPaletteAVX2() == false)
+		printf("  avx2 not supported by this CPU\n");
+
+	return failures == 0 ? 0 : 1;
+}
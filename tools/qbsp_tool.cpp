@@ -0,0 +1,165 @@
+// Command line access to the BSP loader, never opens a window nor touches the GPU
+
+#include <raylib.h>
+
+#include "bsp.h"
+#include "bsp_file.h"
+#include "map_cache.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static int
+Usage()
+{
+	fprintf(stderr,
+			"usage: qbsp-tool [-v] <command> [options] <map.bsp>...\n"
+			"\n"
+			"commands:\n"
+			"  info                 Process each map and print what it turns into\n"
+			"  cache [-o dir]       Process each map and write its cache, to " MAP_CACHE_DIR " by default\n"
+			"  textures -o dir      Write the textures and lightmap atlas of each map as PNG files\n");
+	return 2;
+}
+
+static void
+PrintInfo(const std::filesystem::path& path, const Map_Data& data, double milliseconds)
+{
+	const Mesh_Data& mesh = data.mesh;
+	size_t texture_bytes = 0;
+	for (const Texture_Data& texture : data.textures)
+		texture_bytes += texture.pixels.size() * sizeof(Color_RGB8);
+
+	printf("%s\n", path.string().c_str());
+	printf("  processed in %.2f ms\n", milliseconds);
+	printf("  %zu vertices (%zu unwelded), %zu triangles\n", mesh.vertices.size(), mesh.soup_vertex_count, mesh.indices.size() / 3);
+	printf("  %zu KiB of packed vertices, %zu surfaces\n", data.packed_mesh.vertices.size() * sizeof(Packed_Vertex) / 1024,
+		   data.packed_mesh.surfaces.size());
+	printf("  %zu textures, %zu KiB with mipmaps\n", data.textures.size(), texture_bytes / 1024);
+	printf("  %dx%d lightmap atlas\n", data.lightmap.width, data.lightmap.height);
+	printf("  %zu nodes, %zu leaves, %zu bytes of visibility\n", data.tree.nodes.size(), data.tree.leaves.size(), data.tree.visibility.size());
+}
+
+// Texture names are raw bytes from the map, and liquids start with '*', which Windows reserves
+static std::string
+TextureFileName(const std::string& textureName)
+{
+	std::string fileName = textureName;
+	for (char& c : fileName)
+	{
+		if (c == '*')
+			c = '#';
+		else if ((unsigned char)c < ' ' || strchr("<>:\"/\\|?", c) != nullptr)
+			c = '_';
+	}
+	return fileName + ".png";
+}
+
+static void
+ExportTextures(const std::filesystem::path& path, const Map_Data& data, const std::filesystem::path& outputDir)
+{
+	std::filesystem::path mapDir = outputDir / path.stem();
+	std::filesystem::create_directories(mapDir);
+
+	// Only the full size level, the others follow it in the same buffer
+	for (const Texture_Data& texture : data.textures)
+	{
+		Image image = {
+			.data = (void*)texture.pixels.data(),
+			.width = texture.width,
+			.height = texture.height,
+			.mipmaps = 1,
+			.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8,
+		};
+		std::string fileName = (mapDir / TextureFileName(texture.name)).string();
+		if (ExportImage(image, fileName.c_str()) == false)
+			throw std::runtime_error("Failed to write " + fileName);
+	}
+
+	Image lightmap = {
+		.data = (void*)data.lightmap.pixels.data(),
+		.width = data.lightmap.width,
+		.height = data.lightmap.height,
+		.mipmaps = 1,
+		.format = PIXELFORMAT_UNCOMPRESSED_GRAYSCALE,
+	};
+	std::string fileName = (mapDir / "lightmap.png").string();
+	if (lightmap.data != nullptr && ExportImage(lightmap, fileName.c_str()) == false)
+		throw std::runtime_error("Failed to write " + fileName);
+
+	printf("%s: %zu textures written to %s\n", path.string().c_str(), data.textures.size(), mapDir.string().c_str());
+}
+
+int
+main(int argc, char** argv)
+{
+	std::vector<std::string> args(argv + 1, argv + argc);
+
+	SetTraceLogLevel(LOG_WARNING);
+	if (args.empty() == false && args.front() == "-v")
+	{
+		SetTraceLogLevel(LOG_INFO);
+		args.erase(args.begin());
+	}
+	if (args.empty())
+		return Usage();
+
+	std::string command = args.front();
+	args.erase(args.begin());
+
+	std::filesystem::path outputDir = command == "cache" ? MAP_CACHE_DIR : "";
+	if (args.size() >= 2 && args.front() == "-o")
+	{
+		outputDir = args[1];
+		args.erase(args.begin(), args.begin() + 2);
+	}
+
+	if (args.empty() || (command != "info" && command != "cache" && command != "textures") || (command == "textures" && outputDir.empty()))
+		return Usage();
+
+	int failures = 0;
+	for (const std::string& arg : args)
+	{
+		std::filesystem::path path = arg;
+		try
+		{
+			auto start = std::chrono::steady_clock::now();
+			BSP_File map{path};
+			std::optional<Map_Data> data = LoadMapDataFromBSPFile(map);
+			double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+			if (command == "info")
+			{
+				PrintInfo(path, *data, milliseconds);
+			}
+			else if (command == "cache")
+			{
+				uint64_t sourceHash = HashBytes(map.file.bytes);
+				std::filesystem::path cachePath = MapCachePath(outputDir, sourceHash);
+				SaveMapCache(cachePath, sourceHash, *data, false);
+				printf("%s: cached to %s\n", path.string().c_str(), cachePath.string().c_str());
+			}
+			else if (command == "textures")
+			{
+				ExportTextures(path, *data, outputDir);
+			}
+		}
+		catch (const std::exception& e)
+		{
+			fprintf(stderr, "%s: %s\n", path.string().c_str(), e.what());
+			++failures;
+		}
+		catch (const char* e)
+		{
+			fprintf(stderr, "%s: %s\n", path.string().c_str(), e);
+			++failures;
+		}
+	}
+	return failures == 0 ? 0 : 1;
+}
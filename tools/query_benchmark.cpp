@@ -0,0 +1,477 @@
+// Times the spatial queries the viewer runs against a loaded map, in queries per second
+
+#include <raylib.h>
+#include <raymath.h>
+
+#include "bsp.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include "vis.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+constexpr float CAMERA_STEP = 5; // Units per frame running at 320 units per second, 60 frames per second
+constexpr float TRACE_LENGTH = 256;
+constexpr float RAY_LENGTH = 8192;
+constexpr size_t BRUTE_FORCE_RAYS = 1000; // Testing every face takes long, only the first rays are checked
+constexpr int CLUSTER_VIEWS = 256;
+constexpr int CLUSTER_SAMPLES = 256;    // Points checked in each view
+constexpr size_t RANDOM_LIGHTS = 1000;
+
+// Results go here so the work producing them is not optimized away
+static volatile int64_t sink = 0;
+
+// Median time of one pass over every query
+static double
+MedianSeconds(int iterations, const std::function<void()>& fn)
+{
+	std::vector<double> times;
+	for (int i = 0; i < iterations; ++i)
+	{
+		auto start = std::chrono::steady_clock::now();
+		fn();
+		auto end = std::chrono::steady_clock::now();
+		times.push_back(std::chrono::duration<double>(end - start).count());
+	}
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+// The descent every lookup used to do, the reference for the others
+static int32_t
+NaiveFindLeaf(const Map_Tree& tree, Vector3 point)
+{
+	int32_t node_id = tree.root_node;
+	while (node_id >= 0)
+	{
+		const Node& node = tree.nodes[node_id];
+		const Plane& plane = tree.planes[node.plane_id];
+		node_id = Vector3DotProduct(plane.normal, point) - plane.dist >= 0 ? node.front : node.back;
+	}
+	return ~node_id;
+}
+
+// Straight lines between the centers of random empty leaves, one point per frame
+static std::vector<Vector3>
+CameraPath(const Map_Tree& tree, std::mt19937& random, int waypoint_count)
+{
+	std::vector<Vector3> waypoints;
+	for (const Leaf& leaf : tree.leaves)
+	{
+		if (leaf.type == CONTENTS_EMPTY)
+			waypoints.push_back(Vector3Scale({float(leaf.bound.min.x + leaf.bound.max.x), float(leaf.bound.min.y + leaf.bound.max.y),
+											  float(leaf.bound.min.z + leaf.bound.max.z)}, 0.5f));
+	}
+	std::shuffle(waypoints.begin(), waypoints.end(), random);
+	waypoints.resize(std::min<size_t>(waypoints.size(), waypoint_count));
+
+	std::vector<Vector3> path;
+	for (size_t i = 1; i < waypoints.size(); ++i)
+	{
+		float distance = Vector3Distance(waypoints[i - 1], waypoints[i]);
+		int steps = std::max(1, int(distance / CAMERA_STEP));
+		for (int step = 0; step < steps; ++step)
+			path.push_back(Vector3Lerp(waypoints[i - 1], waypoints[i], float(step) / steps));
+	}
+	return path;
+}
+
+static int
+BenchmarkLeafLookups(const Map_Tree& tree, const char* name, const std::vector<Vector3>& points, int iterations)
+{
+	std::vector<int32_t> expected(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+		expected[i] = NaiveFindLeaf(tree, points[i]);
+
+	std::vector<int32_t> leafIds(points.size());
+	Leaf_Cache cache;
+	struct Method
+	{
+		const char* name;
+		std::function<void()> fn;
+	};
+	Method methods[] = {
+		{"naive", [&] {
+			 for (size_t i = 0; i < points.size(); ++i)
+				 leafIds[i] = NaiveFindLeaf(tree, points[i]);
+		 }},
+		{"FindLeaf", [&] {
+			 for (size_t i = 0; i < points.size(); ++i)
+				 leafIds[i] = FindLeaf(tree, points[i]);
+		 }},
+		{"PointInLeaf", [&] {
+			 cache = {};
+			 for (size_t i = 0; i < points.size(); ++i)
+				 leafIds[i] = PointInLeaf(tree, points[i], cache);
+		 }},
+		{"PointsInLeaves", [&] { PointsInLeaves(tree, points, leafIds); }},
+	};
+
+	printf("  %s, %zu points\n", name, points.size());
+	int failures = 0;
+	double naiveSeconds = 0;
+	for (const Method& method : methods)
+	{
+		double seconds = MedianSeconds(iterations, method.fn);
+		sink = sink + leafIds.back();
+		if (naiveSeconds == 0)
+			naiveSeconds = seconds;
+
+		printf("    %-16s %10.1f Mlookups/s %8.2fx", method.name, points.size() / seconds / 1e6, naiveSeconds / seconds);
+		if (method.name == std::string("PointInLeaf"))
+			printf("  %.1f%% cache hits", 100.0 * cache.hits / std::max<size_t>(cache.hits + cache.misses, 1));
+		printf("\n");
+
+		if (leafIds != expected)
+		{
+			printf("MISMATCH %s finds other leaves than the naive descent\n", method.name);
+			++failures;
+		}
+	}
+	return failures;
+}
+
+// Segments of TRACE_LENGTH in random directions, starting from the points
+static void
+TraceSegments(const std::vector<Vector3>& points, std::mt19937& random, std::vector<Vector3>& starts, std::vector<Vector3>& ends)
+{
+	std::normal_distribution<float> normal;
+	for (Vector3 start : points)
+	{
+		Vector3 direction = Vector3Normalize({normal(random), normal(random), normal(random)});
+		starts.push_back(start);
+		ends.push_back(Vector3Add(start, Vector3Scale(direction, TRACE_LENGTH)));
+	}
+}
+
+static bool
+SameTrace(const Hull_Trace& a, const Hull_Trace& b)
+{
+	return a.fraction == b.fraction && Vector3Equals(a.end, b.end) && a.contents == b.contents && a.start_solid == b.start_solid &&
+		   a.all_solid == b.all_solid;
+}
+
+static int
+BenchmarkTraces(const Map_Tree& tree, const char* name, Hull hull, const std::vector<Vector3>& starts, const std::vector<Vector3>& ends,
+				int iterations)
+{
+	std::vector<Hull_Trace> expected(starts.size());
+	double singleSeconds = MedianSeconds(iterations, [&] {
+		for (size_t i = 0; i < starts.size(); ++i)
+			expected[i] = TraceHull(tree, hull, starts[i], ends[i]);
+		sink = sink + expected.back().contents;
+	});
+
+	std::vector<Hull_Trace> traces;
+	double batchSeconds = MedianSeconds(iterations, [&] {
+		TraceHulls(tree, hull, starts, ends, traces);
+		sink = sink + traces.back().contents;
+	});
+
+	size_t hits = 0;
+	int failures = 0;
+	for (size_t i = 0; i < starts.size(); ++i)
+	{
+		hits += expected[i].fraction < 1;
+		// A trace leaving the open never ends inside a solid
+		if (expected[i].start_solid == false && HullContents(tree, hull, expected[i].end) == CONTENTS_SOLID)
+			++failures;
+	}
+	if (failures != 0)
+		printf("MISMATCH %s: %d traces end in a solid\n", name, failures);
+	for (size_t i = 0; i < starts.size(); ++i)
+	{
+		if (SameTrace(traces[i], expected[i]) == false)
+		{
+			printf("MISMATCH %s: TraceHulls differs from TraceHull\n", name);
+			++failures;
+			break;
+		}
+	}
+
+	printf("  %s, %zu traces of %.0f units, %.1f%% hit something\n", name, starts.size(), TRACE_LENGTH, 100.0 * hits / starts.size());
+	printf("    %-16s %10.2f Mtraces/s %8.2fx\n", "TraceHull", starts.size() / singleSeconds / 1e6, 1.0);
+	printf("    %-16s %10.2f Mtraces/s %8.2fx  %zu threads\n", "TraceHulls", starts.size() / batchSeconds / 1e6, singleSeconds / batchSeconds,
+		   DefaultThreadPool().size() + 1);
+	return failures;
+}
+
+struct Face_Plane
+{
+	uint32_t face_id;
+	Vector3 normal; // Facing where the face is seen from
+	float dist;
+};
+
+// Nearest face seen from the front along the ray, testing all of them, -1 if there is none
+static int32_t
+BruteForceCastRay(const Map_Tree& tree, const std::vector<Face_Plane>& faces, Ray ray, float maxDistance)
+{
+	Vector3 direction = Vector3Normalize(ray.direction);
+	int32_t nearest = -1;
+	for (const Face_Plane& face : faces)
+	{
+		float denominator = Vector3DotProduct(face.normal, direction);
+		if (denominator >= 0)
+			continue;
+		float distance = (face.dist - Vector3DotProduct(face.normal, ray.position)) / denominator;
+		if (distance < 0 || distance >= maxDistance)
+			continue;
+
+		// Inside when on the same side of every edge
+		Vector3 point = Vector3Add(ray.position, Vector3Scale(direction, distance));
+		uint32_t first = tree.face_first_vertices[face.face_id], count = tree.face_first_vertices[face.face_id + 1] - first;
+		int positive = 0, negative = 0;
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			Vector3 a = tree.face_vertices[first + i], b = tree.face_vertices[first + (i + 1) % count];
+			float side = Vector3DotProduct(Vector3CrossProduct(Vector3Subtract(b, a), Vector3Subtract(point, a)), face.normal);
+			positive += side > 0;
+			negative += side < 0;
+		}
+		if (positive == 0 || negative == 0)
+		{
+			nearest = face.face_id;
+			maxDistance = distance;
+		}
+	}
+	return nearest;
+}
+
+static int
+BenchmarkRays(const Map_Tree& tree, const char* name, const std::vector<Ray>& rays, int iterations)
+{
+	std::vector<Ray_Hit> expected(rays.size());
+	double singleSeconds = MedianSeconds(iterations, [&] {
+		for (size_t i = 0; i < rays.size(); ++i)
+			expected[i] = CastRay(tree, rays[i], RAY_LENGTH);
+		sink = sink + expected.back().face_id;
+	});
+
+	std::vector<Ray_Hit> hits;
+	double batchSeconds = MedianSeconds(iterations, [&] {
+		CastRays(tree, rays, RAY_LENGTH, hits);
+		sink = sink + hits.back().face_id;
+	});
+
+	// Faces of the world are the ones lying on its nodes
+	std::vector<Face_Plane> faces;
+	for (const Node& node : tree.nodes)
+	{
+		const Plane& plane = tree.planes[node.plane_id];
+		for (uint32_t faceId = node.face_id; faceId < (uint32_t)node.face_id + node.face_num; ++faceId)
+		{
+			bool back = tree.face_sides[faceId] != 0;
+			faces.push_back({faceId, back ? Vector3Negate(plane.normal) : plane.normal, back ? -plane.dist : plane.dist});
+		}
+	}
+	// Rays starting in a solid stop right away, testing every face would still find one
+	size_t checked = 0, agreed = 0, faceHits = 0;
+	for (size_t i = 0; i < rays.size() && checked < BRUTE_FORCE_RAYS; ++i)
+	{
+		if (tree.leaves[FindLeaf(tree, rays[i].position)].type == CONTENTS_SOLID)
+			continue;
+		agreed += BruteForceCastRay(tree, faces, rays[i], RAY_LENGTH) == expected[i].face_id;
+		++checked;
+	}
+	for (const Ray_Hit& hit : expected)
+		faceHits += hit.face_id >= 0;
+
+	int failures = 0;
+	double agreement = 100.0 * agreed / std::max<size_t>(checked, 1);
+	if (agreement < 99)
+	{
+		printf("MISMATCH %s: %.1f%% of the rays hit the same face as testing every face\n", name, agreement);
+		++failures;
+	}
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		if (hits[i].face_id != expected[i].face_id || hits[i].distance != expected[i].distance)
+		{
+			printf("MISMATCH %s: CastRays differs from CastRay\n", name);
+			++failures;
+			break;
+		}
+	}
+
+	printf("  %s, %zu rays, %.1f%% hit a face, %.1f%% agree with testing every face\n", name, rays.size(), 100.0 * faceHits / rays.size(), agreement);
+	printf("    %-16s %10.2f Mrays/s %10.2fx\n", "CastRay", rays.size() / singleSeconds / 1e6, 1.0);
+	printf("    %-16s %10.2f Mrays/s %10.2fx  %zu threads\n", "CastRays", rays.size() / batchSeconds / 1e6, singleSeconds / batchSeconds,
+		   DefaultThreadPool().size() + 1);
+	return failures;
+}
+
+// Cluster of a point in view space the way lighting.frag finds it
+static int
+PointCluster(const Light_Clusters& clusters, Matrix projection, Vector3 point)
+{
+	float depth = -point.z;
+	Vector2 ndc = {projection.m0 * point.x / depth, projection.m5 * point.y / depth};
+	int x = std::clamp(int((ndc.x * 0.5f + 0.5f) * CLUSTER_COUNT_X), 0, CLUSTER_COUNT_X - 1);
+	int y = std::clamp(int((ndc.y * 0.5f + 0.5f) * CLUSTER_COUNT_Y), 0, CLUSTER_COUNT_Y - 1);
+	int z = int(std::log(std::max(depth, clusters.near_depth) / clusters.near_depth) / std::log(clusters.far_depth / clusters.near_depth) * CLUSTER_COUNT_Z);
+	z = std::clamp(z, 0, CLUSTER_COUNT_Z - 1);
+	return (z * CLUSTER_COUNT_Y + y) * CLUSTER_COUNT_X + x;
+}
+
+// Assigns the lights, in viewer coordinates, to the clusters of views looking around from the points
+static int
+BenchmarkLightClusters(const char* name, const std::vector<Vector4>& lights, const std::vector<Vector3>& eyes, std::mt19937& random, int iterations)
+{
+	// What the viewer draws with, raylib's default clip planes
+	Matrix projection = MatrixPerspective(90 * DEG2RAD, 16.0 / 9.0, 0.01, 1000);
+	std::uniform_real_distribution<float> unit{-1, 1};
+	std::vector<Matrix> views;
+	for (int i = 0; i < CLUSTER_VIEWS; ++i)
+	{
+		Vector3 eye = FromQuake(eyes[random() % eyes.size()]);
+		Vector3 direction = Vector3Normalize({unit(random), unit(random) * 0.5f, unit(random)});
+		views.push_back(MatrixLookAt(eye, Vector3Add(eye, direction), {0, 1, 0}));
+	}
+
+	std::vector<std::vector<Vector4>> viewLights(views.size());
+	for (size_t i = 0; i < views.size(); ++i)
+	{
+		for (const Vector4& light : lights)
+		{
+			Vector3 center = Vector3Transform({light.x, light.y, light.z}, views[i]);
+			viewLights[i].push_back({center.x, center.y, center.z, light.w});
+		}
+	}
+
+	Light_Clusters clusters;
+	double seconds = MedianSeconds(iterations, [&] {
+		for (const std::vector<Vector4>& spheres : viewLights)
+			AssignLightClusters(spheres, projection, clusters);
+		sink = sink + clusters.light_ids.size();
+	});
+
+	// Every light containing a point must be in the cluster of the point
+	size_t assigned = 0, most = 0, missed = 0;
+	for (const std::vector<Vector4>& spheres : viewLights)
+	{
+		AssignLightClusters(spheres, projection, clusters);
+		assigned += clusters.light_ids.size();
+		for (int i = 0; i < CLUSTER_COUNT; ++i)
+			most = std::max<size_t>(most, clusters.offsets[i + 1] - clusters.offsets[i]);
+
+		std::uniform_real_distribution<float> slice{0, 1};
+		for (int sample = 0; sample < CLUSTER_SAMPLES; ++sample)
+		{
+			float depth = clusters.near_depth * std::pow(clusters.far_depth / clusters.near_depth, slice(random));
+			Vector3 point = {unit(random) * depth / projection.m0, unit(random) * depth / projection.m5, -depth};
+			int clusterId = PointCluster(clusters, projection, point);
+			auto first = clusters.light_ids.begin() + clusters.offsets[clusterId], last = clusters.light_ids.begin() + clusters.offsets[clusterId + 1];
+			for (uint32_t lightId = 0; lightId < spheres.size(); ++lightId)
+			{
+				const Vector4& light = spheres[lightId];
+				if (Vector3Distance(point, {light.x, light.y, light.z}) < light.w && std::find(first, last, lightId) == last)
+					++missed;
+			}
+		}
+	}
+
+	printf("  %s, %zu lights, %zu views, %.1f lights per cluster, at most %zu\n", name, lights.size(), views.size(),
+		   double(assigned) / views.size() / CLUSTER_COUNT, most);
+	printf("    %-16s %10.1f us/view\n", "AssignLights", seconds / views.size() * 1e6);
+	if (missed != 0)
+	{
+		printf("MISMATCH %s: %zu lights reach points outside of their clusters\n", name, missed);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+Usage()
+{
+	fprintf(stderr, "usage: query-benchmark [-n iterations] [--seed N] [map.bsp]\n");
+	return 2;
+}
+
+int
+main(int argc, char** argv)
+{
+	int iterations = 20;
+	uint32_t seed = 1;
+	std::filesystem::path path = MAP_SOURCE_DIR "/bsp/dm4.bsp";
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "-n" && hasValue)
+			iterations = std::max(1, atoi(argv[++i]));
+		else if (arg == "--seed" && hasValue)
+			seed = strtoul(argv[++i], nullptr, 10);
+		else if (arg.starts_with("-"))
+			return Usage();
+		else
+			path = arg;
+	}
+
+	SetTraceLogLevel(LOG_WARNING);
+	std::optional<Map_Data> data;
+	try
+	{
+		data = LoadMapDataFromBSPFile(path);
+	}
+	catch (const std::exception& e)
+	{
+		fprintf(stderr, "%s: %s\n", path.string().c_str(), e.what());
+		return 1;
+	}
+	const Map_Tree& tree = data->tree;
+
+	std::mt19937 random{seed};
+	std::vector<Vector3> cameraPath = CameraPath(tree, random, 64);
+	if (cameraPath.empty())
+	{
+		fprintf(stderr, "%s: no empty leaves to walk through\n", path.string().c_str());
+		return 1;
+	}
+	std::vector<Vector3> scattered = cameraPath;
+	std::shuffle(scattered.begin(), scattered.end(), random);
+
+	printf("%s, %d iterations\n", path.string().c_str(), iterations);
+	int failures = 0;
+	failures += BenchmarkLeafLookups(tree, "camera path", cameraPath, iterations);
+	failures += BenchmarkLeafLookups(tree, "scattered", scattered, iterations);
+
+	std::vector<Vector3> traceStarts, traceEnds;
+	TraceSegments(cameraPath, random, traceStarts, traceEnds);
+	failures += BenchmarkTraces(tree, "point hull", HULL_POINT, traceStarts, traceEnds, iterations);
+	failures += BenchmarkTraces(tree, "player hull", HULL_PLAYER, traceStarts, traceEnds, iterations);
+
+	std::vector<Ray> rays;
+	for (size_t i = 0; i < traceStarts.size(); ++i)
+		rays.push_back({traceStarts[i], Vector3Subtract(traceEnds[i], traceStarts[i])});
+	failures += BenchmarkRays(tree, "rays", rays, iterations);
+
+	// Same spheres the viewer uploads
+	float scale = Vector3Length(FromQuake({1, 0, 0}));
+	std::vector<Vector4> mapLights, randomLights;
+	for (const Map_Light& light : data->lights)
+	{
+		Vector3 position = FromQuake(light.position);
+		mapLights.push_back({position.x, position.y, position.z, light.intensity / light.falloff * scale});
+	}
+	std::uniform_real_distribution<float> radius{100, 400};
+	for (size_t i = 0; i < RANDOM_LIGHTS; ++i)
+	{
+		Vector3 position = FromQuake(cameraPath[random() % cameraPath.size()]);
+		randomLights.push_back({position.x, position.y, position.z, radius(random) * scale});
+	}
+	failures += BenchmarkLightClusters("map lights", mapLights, cameraPath, random, iterations);
+	failures += BenchmarkLightClusters("random lights", randomLights, cameraPath, random, iterations);
+	return failures == 0 ? 0 : 1;
+}
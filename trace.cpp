@@ -0,0 +1,280 @@
+#include <raylib.h>
+#include <raymath.h>
+
+#include "thread_pool.h"
+#include "trace.h"
+#include "vis.h"
+
+#include <algorithm>
+
+#include <assert.h>
+
+// Traces stop this far in front of what they hit so their end is never found on the other side of a plane
+constexpr float DIST_EPSILON = 0.03125f;
+
+// Floors are planes steeper than this, as in Quake
+constexpr float FLOOR_MIN_NORMAL_Z = 0.7f;
+
+// Points this far outside of an edge still count as on the face, so rays do not slip between neighbours
+constexpr float EDGE_EPSILON = 0.01f;
+
+// Traces and rays take a microsecond or so, each task of a batch gets enough of them to be worth handing out
+constexpr size_t BATCH_SIZE = 256;
+
+static int32_t
+NodeContents(const Map_Tree& tree, int32_t node_id, Vector3 point)
+{
+	while (node_id >= 0)
+	{
+		const Hull_Node& node = tree.hull_nodes[node_id];
+		node_id = node.children[PlaneDistance(tree.planes[node.plane_id], point) < 0];
+	}
+	return node_id;
+}
+
+int32_t
+HullContents(const Map_Tree& tree, Hull hull, Vector3 point)
+{
+	return NodeContents(tree, tree.hull_roots[hull], point);
+}
+
+// Traces the part of the segment between p1 and p2 inside a node, the fractions are where they are on the whole
+// segment. Returns false once the trace stopped.
+static bool
+TraceNode(const Map_Tree& tree, int32_t root, int32_t node_id, float p1_fraction, float p2_fraction, Vector3 p1, Vector3 p2, Hull_Trace& trace)
+{
+	if (node_id < 0)
+	{
+		if (node_id == CONTENTS_SOLID)
+			trace.start_solid = true;
+		else
+		{
+			trace.all_solid = false;
+			trace.contents = node_id;
+		}
+		return true;
+	}
+
+	const Hull_Node& node = tree.hull_nodes[node_id];
+	const Plane& plane = tree.planes[node.plane_id];
+	float t1 = PlaneDistance(plane, p1);
+	float t2 = PlaneDistance(plane, p2);
+	if (t1 >= 0 && t2 >= 0)
+		return TraceNode(tree, root, node.children[0], p1_fraction, p2_fraction, p1, p2, trace);
+	if (t1 < 0 && t2 < 0)
+		return TraceNode(tree, root, node.children[1], p1_fraction, p2_fraction, p1, p2, trace);
+
+	// The segment crosses the plane, the side of p1 goes up to just before it
+	float fraction = std::clamp(t1 < 0 ? (t1 + DIST_EPSILON) / (t1 - t2) : (t1 - DIST_EPSILON) / (t1 - t2), 0.f, 1.f);
+	float mid_fraction = p1_fraction + (p2_fraction - p1_fraction) * fraction;
+	Vector3 mid = Vector3Lerp(p1, p2, fraction);
+	int side = t1 < 0;
+	if (TraceNode(tree, root, node.children[side], p1_fraction, mid_fraction, p1, mid, trace) == false)
+		return false;
+
+	if (NodeContents(tree, node.children[side ^ 1], mid) != CONTENTS_SOLID)
+		return TraceNode(tree, root, node.children[side ^ 1], mid_fraction, p2_fraction, mid, p2, trace);
+	if (trace.all_solid)
+		return false; // Never got out of the solid
+
+	// The other side is solid, the trace stops on this plane
+	trace.plane = plane;
+	if (side)
+	{
+		trace.plane.normal = Vector3Negate(plane.normal);
+		trace.plane.dist = -plane.dist;
+		trace.plane.type = 3; // No longer facing along the positive axis
+	}
+	trace.contents = CONTENTS_SOLID;
+
+	// Rounding can still leave mid in a solid, back off until the whole hull says it is out
+	while (NodeContents(tree, root, mid) == CONTENTS_SOLID)
+	{
+		fraction -= 0.1f;
+		if (fraction < 0)
+			break;
+		mid_fraction = p1_fraction + (p2_fraction - p1_fraction) * fraction;
+		mid = Vector3Lerp(p1, p2, fraction);
+	}
+	trace.fraction = mid_fraction;
+	trace.end = mid;
+	return false;
+}
+
+Hull_Trace
+TraceHull(const Map_Tree& tree, Hull hull, Vector3 start, Vector3 end)
+{
+	Hull_Trace trace{
+		.fraction = 1,
+		.end = end,
+		.plane = {},
+		.contents = CONTENTS_EMPTY,
+		.start_solid = false,
+		.all_solid = true,
+	};
+	int32_t root = tree.hull_roots[hull];
+	TraceNode(tree, root, root, 0, 1, start, end, trace);
+	if (trace.all_solid)
+	{
+		trace.fraction = 0;
+		trace.end = start;
+		trace.contents = CONTENTS_SOLID;
+	}
+	return trace;
+}
+
+void
+TraceHulls(const Map_Tree& tree, Hull hull, std::span<const Vector3> starts, std::span<const Vector3> ends, std::vector<Hull_Trace>& traces)
+{
+	assert(starts.size() == ends.size());
+	traces.resize(starts.size());
+
+	size_t batch_count = (starts.size() + BATCH_SIZE - 1) / BATCH_SIZE;
+	DefaultThreadPool().parallel_for(batch_count, [&](size_t batch) {
+		size_t end = std::min(starts.size(), (batch + 1) * BATCH_SIZE);
+		for (size_t i = batch * BATCH_SIZE; i < end; ++i)
+			traces[i] = TraceHull(tree, hull, starts[i], ends[i]);
+	});
+}
+
+// Whether a point on the plane of a face is inside its outline, which is convex and may wind either way
+static bool
+PointInFace(const Map_Tree& tree, uint32_t face_id, Vector3 normal, Vector3 point)
+{
+	uint32_t first = tree.face_first_vertices[face_id];
+	uint32_t count = tree.face_first_vertices[face_id + 1] - first;
+	float min_side = 0, max_side = 0;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Vector3 a = tree.face_vertices[first + i];
+		Vector3 edge = Vector3Subtract(tree.face_vertices[first + (i + 1) % count], a);
+		float length = Vector3Length(edge);
+		if (length == 0)
+			continue;
+		float side = Vector3DotProduct(Vector3CrossProduct(edge, Vector3Subtract(point, a)), normal) / length;
+		min_side = std::min(min_side, side);
+		max_side = std::max(max_side, side);
+	}
+	return min_side >= -EDGE_EPSILON || max_side <= EDGE_EPSILON;
+}
+
+// Face of the node seen from the front by the ray with point inside of it, -1 if there is none
+static int32_t
+FaceAt(const Map_Tree& tree, const Node& node, Vector3 point, Vector3 direction)
+{
+	const Plane& plane = tree.planes[node.plane_id];
+	for (uint32_t face_id = node.face_id; face_id < (uint32_t)node.face_id + node.face_num; ++face_id)
+	{
+		Vector3 normal = tree.face_sides[face_id] ? Vector3Negate(plane.normal) : plane.normal;
+		if (Vector3DotProduct(normal, direction) < 0 && PointInFace(tree, face_id, normal, point))
+			return face_id;
+	}
+	return -1;
+}
+
+// Casts the part of the ray between p1 and p2 inside a node, d1 and d2 are how far they are from the origin.
+// entry_normal faces back through the last plane crossed. Returns true once the ray stopped.
+static bool
+CastNode(const Map_Tree& tree, int32_t node_id, Vector3 p1, Vector3 p2, float d1, float d2, Vector3 direction, Vector3 entry_normal,
+		 Ray_Hit& hit)
+{
+	if (node_id < 0)
+	{
+		if (tree.leaves[~node_id].type != CONTENTS_SOLID)
+			return false;
+		hit.hit = true;
+		hit.distance = d1;
+		hit.position = p1;
+		hit.normal = entry_normal;
+		return true;
+	}
+
+	const Node& node = tree.nodes[node_id];
+	const Plane& plane = tree.planes[node.plane_id];
+	float t1 = PlaneDistance(plane, p1);
+	float t2 = PlaneDistance(plane, p2);
+	if (t1 >= 0 && t2 >= 0)
+		return CastNode(tree, node.front, p1, p2, d1, d2, direction, entry_normal, hit);
+	if (t1 < 0 && t2 < 0)
+		return CastNode(tree, node.back, p1, p2, d1, d2, direction, entry_normal, hit);
+
+	// Nearest side first, then the faces on the plane, then the far side
+	float fraction = t1 / (t1 - t2);
+	Vector3 mid = Vector3Lerp(p1, p2, fraction);
+	float mid_distance = d1 + (d2 - d1) * fraction;
+	int side = t1 < 0;
+	if (CastNode(tree, side ? node.back : node.front, p1, mid, d1, mid_distance, direction, entry_normal, hit))
+		return true;
+
+	int32_t face_id = FaceAt(tree, node, mid, direction);
+	Vector3 plane_normal = side ? Vector3Negate(plane.normal) : plane.normal;
+	if (face_id < 0)
+		return CastNode(tree, side ? node.front : node.back, mid, p2, mid_distance, d2, direction, plane_normal, hit);
+
+	const Draw_Range& range = tree.face_ranges[face_id];
+	hit.hit = true;
+	hit.distance = mid_distance;
+	hit.position = mid;
+	hit.normal = plane_normal;
+	hit.face_id = face_id;
+	hit.texinfo_id = tree.face_texinfo_ids[face_id];
+	hit.texture_id = range.index_count != 0 ? (int32_t)range.texture_id : -1;
+	return true;
+}
+
+Ray_Hit
+CastRay(const Map_Tree& tree, Ray ray, float max_distance)
+{
+	Vector3 direction = Vector3Normalize(ray.direction);
+	Vector3 end = Vector3Add(ray.position, Vector3Scale(direction, max_distance));
+	Ray_Hit hit{
+		.hit = false,
+		.distance = max_distance,
+		.position = end,
+		.normal = {},
+		.face_id = -1,
+		.texinfo_id = -1,
+		.texture_id = -1,
+	};
+	CastNode(tree, tree.root_node, ray.position, end, 0, max_distance, direction, Vector3Negate(direction), hit);
+	return hit;
+}
+
+void
+CastRays(const Map_Tree& tree, std::span<const Ray> rays, float max_distance, std::vector<Ray_Hit>& hits)
+{
+	hits.resize(rays.size());
+	size_t batch_count = (rays.size() + BATCH_SIZE - 1) / BATCH_SIZE;
+	DefaultThreadPool().parallel_for(batch_count, [&](size_t batch) {
+		size_t end = std::min(rays.size(), (batch + 1) * BATCH_SIZE);
+		for (size_t i = batch * BATCH_SIZE; i < end; ++i)
+			hits[i] = CastRay(tree, rays[i], max_distance);
+	});
+}
+
+Vector3
+SlideHull(const Map_Tree& tree, Hull hull, Vector3 start, Vector3 move, bool* on_ground)
+{
+	if (on_ground)
+		*on_ground = false;
+
+	// Each bump slides along one more plane, four are enough to get out of corners as in Quake
+	Vector3 position = start;
+	for (int bump = 0; bump < 4 && Vector3LengthSqr(move) > 0; ++bump)
+	{
+		Hull_Trace trace = TraceHull(tree, hull, position, Vector3Add(position, move));
+		if (trace.all_solid)
+			break; // Stuck, there is nothing to slide along
+		position = trace.end;
+		if (trace.fraction == 1)
+			break;
+
+		if (on_ground && trace.plane.normal.z > FLOOR_MIN_NORMAL_Z)
+			*on_ground = true;
+
+		// What is left of the move, without the part going into the plane
+		move = Vector3Scale(move, 1 - trace.fraction);
+		move = Vector3Subtract(move, Vector3Scale(trace.plane.normal, Vector3DotProduct(move, trace.plane.normal)));
+	}
+	return position;
+}
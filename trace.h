@@ -0,0 +1,61 @@
+#pragma once
+
+#include "bsp.h"
+
+#include <span>
+#include <vector>
+
+// Hulls the world is compiled with, a box moving through the world is a point moving through its hull
+enum Hull
+{
+	HULL_POINT,  // The BSP tree itself
+	HULL_PLAYER, // Grown by the player box, (-16 -16 -24) to (16 16 32)
+	HULL_LARGE,  // Grown by the largest monsters, (-32 -32 -24) to (32 32 64)
+};
+
+struct Hull_Trace
+{
+	float fraction;    // Part of the segment travelled before hitting something, 1 when nothing was hit
+	Vector3 end;       // Where the hull stopped, in Quake coordinates
+	Plane plane;       // The plane hit, facing where the trace came from, only set when fraction < 1
+	int32_t contents;  // CONTENTS_SOLID when something was hit, otherwise the contents at end
+	bool start_solid;  // The start is inside something solid
+	bool all_solid;    // The whole segment is, fraction is then 0
+};
+
+// Contents of the hull at a point in Quake coordinates
+int32_t
+HullContents(const Map_Tree& tree, Hull hull, Vector3 point);
+
+// Sweeps the hull from start to end, both in Quake coordinates, stopping a little before the first solid it meets
+Hull_Trace
+TraceHull(const Map_Tree& tree, Hull hull, Vector3 start, Vector3 end);
+
+// Same as TraceHull for every pair of starts and ends, split across the thread pool when there are many
+void
+TraceHulls(const Map_Tree& tree, Hull hull, std::span<const Vector3> starts, std::span<const Vector3> ends, std::vector<Hull_Trace>& traces);
+
+struct Ray_Hit
+{
+	bool hit;           // Something within the distance the ray was cast to
+	float distance;     // From the origin to position
+	Vector3 position;   // Quake coordinates
+	Vector3 normal;     // Of what was hit, facing the origin
+	int32_t face_id;    // -1 when the ray got into a solid between faces, or started in one
+	int32_t texinfo_id; // -1 without a face
+	int32_t texture_id; // Into Map_Data::textures, which has its name, -1 without a face or when it is not drawn
+};
+
+// Casts a ray in Quake coordinates through the world tree, nearest nodes first, stopping at the first face seen
+// from the front or at the first solid leaf. The direction needs not be normalized.
+Ray_Hit
+CastRay(const Map_Tree& tree, Ray ray, float max_distance);
+
+// Same as CastRay for every ray, split across the thread pool when there are many
+void
+CastRays(const Map_Tree& tree, std::span<const Ray> rays, float max_distance, std::vector<Ray_Hit>& hits);
+
+// Moves the hull by move, sliding along what it hits instead of stopping like a trace does. Returns where it ends up,
+// on_ground tells whether it slid along a floor, something facing up enough to stand on.
+Vector3
+SlideHull(const Map_Tree& tree, Hull hull, Vector3 start, Vector3 move, bool* on_ground = nullptr);
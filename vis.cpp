@@ -0,0 +1,437 @@
+#include <raylib.h>
+#include <raymath.h>
+
+#include "vis.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+int32_t
+FindLeaf(const Map_Tree& tree, Vector3 point)
+{
+	int32_t node_id = tree.root_node;
+	while (node_id >= 0)
+	{
+		const Node& node = tree.nodes[node_id];
+		float distance = PlaneDistance(tree.planes[node.plane_id], point);
+		node_id = distance >= 0 ? node.front : node.back;
+	}
+	return ~node_id;
+}
+
+static bool
+InBounds(const BoundingBox& bounds, Vector3 point)
+{
+	return point.x >= bounds.min.x && point.y >= bounds.min.y && point.z >= bounds.min.z && point.x <= bounds.max.x && point.y <= bounds.max.y &&
+		   point.z <= bounds.max.z;
+}
+
+static bool
+InCachedLeaf(const Leaf_Cache& cache, Vector3 point)
+{
+	if (InBounds(cache.bounds, point) == false)
+		return false;
+
+	for (const Leaf_Plane& leaf_plane : cache.planes)
+	{
+		if ((PlaneDistance(leaf_plane.plane, point) >= 0) != leaf_plane.front)
+			return false;
+	}
+	return true;
+}
+
+// Full descent, keeping what PointInLeaf needs to tell whether the next points are in the same leaf
+static int32_t
+FillLeafCache(const Map_Tree& tree, Vector3 point, Leaf_Cache& cache)
+{
+	cache.planes.clear();
+	int32_t node_id = tree.root_node;
+	while (node_id >= 0)
+	{
+		const Node& node = tree.nodes[node_id];
+		const Plane& plane = tree.planes[node.plane_id];
+		bool front = PlaneDistance(plane, point) >= 0;
+		cache.planes.push_back({plane, front});
+		node_id = front ? node.front : node.back;
+	}
+	cache.leaf_id = ~node_id;
+
+	// Once a point is known to be in the bounds, planes with the whole box on the side of the leaf tell nothing more.
+	// The bounds stored in the file may be a bit smaller than the leaf, points near its edges then take the long way.
+	// The solid leaf 0 is shared by every solid region and has no bounds, all the planes are kept for it.
+	const BoundingBoxS& box = tree.leaves[cache.leaf_id].bound;
+	Vector3 mins = {(float)box.min.x, (float)box.min.y, (float)box.min.z};
+	Vector3 maxs = {(float)box.max.x, (float)box.max.y, (float)box.max.z};
+	cache.bounds = {mins, maxs};
+	if (InBounds(cache.bounds, point) == false)
+	{
+		float infinity = std::numeric_limits<float>::infinity();
+		cache.bounds = {{-infinity, -infinity, -infinity}, {infinity, infinity, infinity}};
+		return cache.leaf_id;
+	}
+
+	std::erase_if(cache.planes, [&](const Leaf_Plane& leaf_plane) {
+		const Plane& plane = leaf_plane.plane;
+		bool front = leaf_plane.front;
+		Vector3 corner = {(plane.normal.x >= 0) == front ? mins.x : maxs.x, (plane.normal.y >= 0) == front ? mins.y : maxs.y,
+						  (plane.normal.z >= 0) == front ? mins.z : maxs.z};
+		return (PlaneDistance(plane, corner) >= 0) == front;
+	});
+	return cache.leaf_id;
+}
+
+int32_t
+PointInLeaf(const Map_Tree& tree, Vector3 point, Leaf_Cache& cache)
+{
+	if (cache.leaf_id >= 0 && InCachedLeaf(cache, point))
+	{
+		++cache.hits;
+		return cache.leaf_id;
+	}
+	++cache.misses;
+	return FillLeafCache(tree, point, cache);
+}
+
+void
+PointsInLeaves(const Map_Tree& tree, std::span<const Vector3> points, std::vector<int32_t>& leaf_ids)
+{
+	// Filling the cache costs about as much as the descent itself. After a few misses in a row the points are
+	// likely scattered, the cache is then only filled again once in a while.
+	Leaf_Cache cache;
+	size_t misses_in_row = 0;
+	leaf_ids.resize(points.size());
+	for (size_t i = 0; i < points.size(); ++i)
+	{
+		if (cache.leaf_id >= 0 && InCachedLeaf(cache, points[i]))
+		{
+			leaf_ids[i] = cache.leaf_id;
+			misses_in_row = 0;
+			continue;
+		}
+
+		++misses_in_row;
+		bool refill = misses_in_row <= 2 || misses_in_row % 8 == 0;
+		leaf_ids[i] = refill ? FillLeafCache(tree, points[i], cache) : FindLeaf(tree, points[i]);
+	}
+}
+
+void
+DecompressVis(const Map_Tree& tree, int32_t leaf_id, std::vector<uint8_t>& leaves_visible)
+{
+	leaves_visible.assign(tree.leaves.size(), 0);
+
+	int32_t offset = leaf_id > 0 ? tree.leaves[leaf_id].visibility_id : -1;
+	if (offset < 0 || (size_t)offset >= tree.visibility.size())
+	{
+		std::fill(leaves_visible.begin() + 1, leaves_visible.end(), 1);
+		return;
+	}
+
+	// A zero byte is followed by how many zero bytes it stands for, bit i is leaf i + 1
+	const uint8_t* in = tree.visibility.data() + offset;
+	const uint8_t* in_end = tree.visibility.data() + tree.visibility.size();
+	size_t leaf_count = std::min<size_t>(tree.visleaf_count, tree.leaves.size() - 1);
+	for (size_t leaf = 0; leaf < leaf_count && in < in_end;)
+	{
+		if (*in == 0)
+		{
+			if (in + 1 == in_end)
+				break;
+			leaf += 8 * in[1];
+			in += 2;
+			continue;
+		}
+
+		for (int bit = 0; bit < 8 && leaf < leaf_count; ++bit, ++leaf)
+			leaves_visible[leaf + 1] = (*in >> bit) & 1;
+		++in;
+	}
+}
+
+static bool
+MarkVisibleNode(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, std::vector<uint8_t>& nodes_visible, int32_t node_id)
+{
+	if (node_id < 0)
+		return leaves_visible[~node_id] != 0;
+
+	const Node& node = tree.nodes[node_id];
+	bool front = MarkVisibleNode(tree, leaves_visible, nodes_visible, node.front);
+	bool back = MarkVisibleNode(tree, leaves_visible, nodes_visible, node.back);
+	nodes_visible[node_id] = front || back;
+	return nodes_visible[node_id];
+}
+
+void
+MarkVisibleNodes(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, std::vector<uint8_t>& nodes_visible)
+{
+	nodes_visible.assign(tree.nodes.size(), 0);
+	MarkVisibleNode(tree, leaves_visible, nodes_visible, tree.root_node);
+}
+
+Frustum
+FrustumFromMatrix(Matrix m)
+{
+	// Rows of the matrix as applied to column vectors, see Gribb & Hartmann
+	Vector4 x = {m.m0, m.m4, m.m8, m.m12};
+	Vector4 y = {m.m1, m.m5, m.m9, m.m13};
+	Vector4 z = {m.m2, m.m6, m.m10, m.m14};
+	Vector4 w = {m.m3, m.m7, m.m11, m.m15};
+
+	Frustum frustum = {{
+		{w.x + x.x, w.y + x.y, w.z + x.z, w.w + x.w},
+		{w.x - x.x, w.y - x.y, w.z - x.z, w.w - x.w},
+		{w.x + y.x, w.y + y.y, w.z + y.z, w.w + y.w},
+		{w.x - y.x, w.y - y.y, w.z - y.z, w.w - y.w},
+		{w.x + z.x, w.y + z.y, w.z + z.z, w.w + z.w},
+		{w.x - z.x, w.y - z.y, w.z - z.z, w.w - z.w},
+	}};
+
+	// FromQuake is linear, dot(n, FromQuake(p)) is dot(n', p) with n' made of n dotted with the converted axes
+	Vector3 axis_x = FromQuake({1, 0, 0});
+	Vector3 axis_y = FromQuake({0, 1, 0});
+	Vector3 axis_z = FromQuake({0, 0, 1});
+	for (Vector4& plane : frustum.planes)
+	{
+		Vector3 normal = {plane.x, plane.y, plane.z};
+		Vector3 quake_normal = {Vector3DotProduct(normal, axis_x), Vector3DotProduct(normal, axis_y), Vector3DotProduct(normal, axis_z)};
+		float length = Vector3Length(quake_normal);
+		plane = {quake_normal.x / length, quake_normal.y / length, quake_normal.z / length, plane.w / length};
+	}
+	return frustum;
+}
+
+// False when the box is outside one of the planes in mask, planes the box is fully inside of are removed from it
+template<typename Box>
+static bool
+BoxInFrustum(const Frustum& frustum, const Box& box, uint8_t& mask)
+{
+	for (int i = 0; i < 6; ++i)
+	{
+		if ((mask & (1 << i)) == 0)
+			continue;
+
+		const Vector4& plane = frustum.planes[i];
+		float farthest = plane.x * (plane.x >= 0 ? box.max.x : box.min.x) + plane.y * (plane.y >= 0 ? box.max.y : box.min.y) +
+					plane.z * (plane.z >= 0 ? box.max.z : box.min.z) + plane.w;
+		if (farthest < 0)
+			return false;
+
+		float nearest = plane.x * (plane.x >= 0 ? box.min.x : box.max.x) + plane.y * (plane.y >= 0 ? box.min.y : box.max.y) +
+					 plane.z * (plane.z >= 0 ? box.min.z : box.max.z) + plane.w;
+		if (nearest >= 0)
+			mask &= ~(1 << i);
+	}
+	return true;
+}
+
+static void
+CullNode(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, const std::vector<uint8_t>& nodes_visible,
+		 const Frustum& frustum, const Vector3* eye, int32_t node_id, uint8_t mask, std::vector<uint32_t>& leaf_ids, Cull_Stats& stats)
+{
+	if (node_id < 0)
+	{
+		int32_t leaf_id = ~node_id;
+		if (leaf_id == 0 || leaves_visible[leaf_id] == 0)
+			return;
+		if (mask != 0 && BoxInFrustum(frustum, tree.leaves[leaf_id].bound, mask) == false)
+		{
+			++stats.nodes_culled;
+			return;
+		}
+		++stats.nodes_visible;
+		leaf_ids.push_back(leaf_id);
+		return;
+	}
+
+	if (nodes_visible[node_id] == 0)
+		return;
+
+	const Node& node = tree.nodes[node_id];
+	if (mask != 0 && BoxInFrustum(frustum, node.box, mask) == false)
+	{
+		++stats.nodes_culled;
+		return;
+	}
+	++stats.nodes_visible;
+
+	// Nothing on the far side of the plane can hide what is on the side of the eye
+	int32_t near_child = node.front, far_child = node.back;
+	if (eye)
+	{
+		const Plane& plane = tree.planes[node.plane_id];
+		if (Vector3DotProduct(plane.normal, *eye) - plane.dist < 0)
+			std::swap(near_child, far_child);
+	}
+	CullNode(tree, leaves_visible, nodes_visible, frustum, eye, near_child, mask, leaf_ids, stats);
+	CullNode(tree, leaves_visible, nodes_visible, frustum, eye, far_child, mask, leaf_ids, stats);
+}
+
+void
+CullLeaves(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, const std::vector<uint8_t>& nodes_visible,
+		   const Frustum* frustum, const Vector3* eye, std::vector<uint32_t>& leaf_ids, Cull_Stats& stats)
+{
+	leaf_ids.clear();
+	stats = {};
+	CullNode(tree, leaves_visible, nodes_visible, frustum ? *frustum : Frustum{}, eye, tree.root_node, frustum ? 0x3f : 0, leaf_ids, stats);
+}
+
+bool
+BoundsInFrustum(const Frustum& frustum, const BoundingBox& bounds)
+{
+	uint8_t mask = 0x3f;
+	return BoxInFrustum(frustum, bounds, mask);
+}
+
+static bool
+BoundsReachVisibleLeaf(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, const std::vector<uint8_t>& nodes_visible,
+					   const BoundingBox& bounds, int32_t node_id)
+{
+	if (node_id < 0)
+	{
+		int32_t leaf_id = ~node_id;
+		return leaf_id != 0 && leaves_visible[leaf_id] != 0;
+	}
+	if (nodes_visible[node_id] == 0)
+		return false;
+
+	// The box goes down every side of the plane it has a corner on
+	const Node& node = tree.nodes[node_id];
+	const Plane& plane = tree.planes[node.plane_id];
+	Vector3 n = plane.normal;
+	float farthest = n.x * (n.x >= 0 ? bounds.max.x : bounds.min.x) + n.y * (n.y >= 0 ? bounds.max.y : bounds.min.y) +
+					 n.z * (n.z >= 0 ? bounds.max.z : bounds.min.z) - plane.dist;
+	float nearest = n.x * (n.x >= 0 ? bounds.min.x : bounds.max.x) + n.y * (n.y >= 0 ? bounds.min.y : bounds.max.y) +
+					n.z * (n.z >= 0 ? bounds.min.z : bounds.max.z) - plane.dist;
+	if (farthest >= 0 && BoundsReachVisibleLeaf(tree, leaves_visible, nodes_visible, bounds, node.front))
+		return true;
+	return nearest < 0 && BoundsReachVisibleLeaf(tree, leaves_visible, nodes_visible, bounds, node.back);
+}
+
+bool
+BoundsVisible(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, const std::vector<uint8_t>& nodes_visible,
+			  const BoundingBox& bounds)
+{
+	return BoundsReachVisibleLeaf(tree, leaves_visible, nodes_visible, bounds, tree.root_node);
+}
+
+// Slices are spread evenly in log depth, so each one is as thick relative to its distance
+static int
+DepthSlice(const Light_Clusters& clusters, float depth)
+{
+	if (depth <= clusters.near_depth)
+		return 0;
+	float slice = std::log(depth / clusters.near_depth) / std::log(clusters.far_depth / clusters.near_depth) * CLUSTER_COUNT_Z;
+	return std::min((int)slice, CLUSTER_COUNT_Z - 1);
+}
+
+// Depth where a slice starts, the first one also takes everything nearer
+static float
+SliceStart(const Light_Clusters& clusters, int slice)
+{
+	return clusters.near_depth * std::pow(clusters.far_depth / clusters.near_depth, float(slice) / CLUSTER_COUNT_Z);
+}
+
+static int
+Tile(float ndc, int count)
+{
+	return std::clamp((int)std::floor((ndc * 0.5f + 0.5f) * count), 0, count - 1);
+}
+
+void
+AssignLightClusters(std::span<const Vector4> spheres, Matrix projection, Light_Clusters& clusters)
+{
+	// Slices nearer than this would be thinner than anything in a map
+	const float MIN_NEAR_DEPTH = 0.5f;
+
+	const Matrix& m = projection;
+	clusters.clip_near = m.m14 / (m.m10 - 1);
+	clusters.clip_far = m.m14 / (m.m10 + 1);
+	clusters.near_depth = std::max(clusters.clip_near, MIN_NEAR_DEPTH);
+	clusters.far_depth = std::max(clusters.clip_far, clusters.near_depth * 2);
+
+	// Lights are bounded slice by slice, by the box around the part of the sphere within the slice
+	std::vector<Light_Clusters::Range>& ranges = clusters.ranges;
+	ranges.clear();
+	clusters.offsets.assign(CLUSTER_COUNT + 1, 0);
+	clusters.light_ids.clear();
+
+	for (uint32_t light_id = 0; light_id < spheres.size(); ++light_id)
+	{
+		// The view looks down -z
+		const Vector4& sphere = spheres[light_id];
+		float center = -sphere.z, nearest = center - sphere.w, farthest = center + sphere.w;
+		if (farthest < clusters.clip_near || nearest > clusters.clip_far)
+			continue;
+
+		for (int z = DepthSlice(clusters, nearest); z <= DepthSlice(clusters, farthest); ++z)
+		{
+			// Depths rounded into the slice are found again with some error, the slice is widened to cover it
+			float slice_near = z == 0 ? clusters.clip_near : SliceStart(clusters, z) * 0.999f;
+			float slice_far = z == CLUSTER_COUNT_Z - 1 ? clusters.clip_far : SliceStart(clusters, z + 1) * 1.001f;
+			float box_near = std::max({nearest, slice_near, clusters.clip_near}), box_far = std::min(farthest, slice_far);
+			if (box_near > box_far)
+				continue;
+			float offset = std::clamp(center, box_near, box_far) - center;
+			float radius = std::sqrt(std::max(sphere.w * sphere.w - offset * offset, 0.0f));
+
+			Vector2 ndc_min = {std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+			Vector2 ndc_max = {-ndc_min.x, -ndc_min.y};
+			for (int corner = 0; corner < 8; ++corner)
+			{
+				Vector3 p = {sphere.x + (corner & 1 ? radius : -radius), sphere.y + (corner & 2 ? radius : -radius), corner & 4 ? -box_far : -box_near};
+				float w = m.m3 * p.x + m.m7 * p.y + m.m11 * p.z + m.m15;
+				Vector2 ndc = {(m.m0 * p.x + m.m4 * p.y + m.m8 * p.z + m.m12) / w, (m.m1 * p.x + m.m5 * p.y + m.m9 * p.z + m.m13) / w};
+				ndc_min = {std::min(ndc_min.x, ndc.x), std::min(ndc_min.y, ndc.y)};
+				ndc_max = {std::max(ndc_max.x, ndc.x), std::max(ndc_max.y, ndc.y)};
+			}
+			if (ndc_max.x < -1 || ndc_max.y < -1 || ndc_min.x > 1 || ndc_min.y > 1)
+				continue;
+
+			Light_Clusters::Range range = {
+				light_id,
+				z,
+				{Tile(ndc_min.x, CLUSTER_COUNT_X), Tile(ndc_min.y, CLUSTER_COUNT_Y)},
+				{Tile(ndc_max.x, CLUSTER_COUNT_X), Tile(ndc_max.y, CLUSTER_COUNT_Y)},
+			};
+			for (int y = range.min[1]; y <= range.max[1]; ++y)
+				for (int x = range.min[0]; x <= range.max[0]; ++x)
+					++clusters.offsets[(z * CLUSTER_COUNT_Y + y) * CLUSTER_COUNT_X + x + 1];
+			ranges.push_back(range);
+		}
+	}
+
+	// Each count sits one past its cluster, summing them up gives where every cluster starts
+	for (int i = 0; i < CLUSTER_COUNT; ++i)
+		clusters.offsets[i + 1] += clusters.offsets[i];
+	clusters.light_ids.resize(clusters.offsets[CLUSTER_COUNT]);
+
+	std::vector<uint32_t>& next = clusters.next;
+	next.assign(clusters.offsets.begin(), clusters.offsets.end() - 1);
+	for (const Light_Clusters::Range& range : ranges)
+	{
+		for (int y = range.min[1]; y <= range.max[1]; ++y)
+			for (int x = range.min[0]; x <= range.max[0]; ++x)
+				clusters.light_ids[next[(range.z * CLUSTER_COUNT_Y + y) * CLUSTER_COUNT_X + x]++] = range.light_id;
+	}
+}
+
+void
+CollectVisibleFaces(const Map_Tree& tree, std::span<const uint32_t> leaf_ids, std::vector<uint32_t>& face_ids)
+{
+	face_ids.clear();
+
+	std::vector<bool> face_listed(tree.face_ranges.size());
+	for (uint32_t leaf_id : leaf_ids)
+	{
+		const Leaf& leaf = tree.leaves[leaf_id];
+		for (size_t i = 0; i < leaf.listface_num; ++i)
+		{
+			uint16_t face_id = tree.listfaces[leaf.listface_id + i];
+			if (face_listed[face_id])
+				continue;
+			face_listed[face_id] = true;
+			face_ids.push_back(face_id);
+		}
+	}
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "bsp.h"
+
+#include <span>
+#include <vector>
+
+// Signed distance of a point to a plane, planes facing along an axis only need one coordinate
+inline float
+PlaneDistance(const Plane& plane, Vector3 point)
+{
+	switch (plane.type)
+	{
+	case 0:
+		return point.x - plane.dist;
+	case 1:
+		return point.y - plane.dist;
+	case 2:
+		return point.z - plane.dist;
+	default:
+		return plane.normal.x * point.x + plane.normal.y * point.y + plane.normal.z * point.z - plane.dist;
+	}
+}
+
+// Leaf containing a point given in Quake coordinates
+int32_t
+FindLeaf(const Map_Tree& tree, Vector3 point);
+
+struct Leaf_Plane
+{
+	Plane plane;
+	bool front; // The leaf is on the front side, where FindLeaf goes when the distance is >= 0
+};
+
+struct Leaf_Cache // The leaf found last and what it takes to tell whether a point is still inside it
+{
+	int32_t leaf_id = -1;
+	BoundingBox bounds;
+	std::vector<Leaf_Plane> planes; // Planes above the leaf crossing its bounds, the others hold for any point in them
+	size_t hits = 0, misses = 0;
+};
+
+// Same as FindLeaf, first checking whether the point is still in the leaf of the previous call with the same
+// cache. Points moving a little at a time, like the camera, rarely go through the whole tree.
+int32_t
+PointInLeaf(const Map_Tree& tree, Vector3 point, Leaf_Cache& cache);
+
+// Leaf of every point, faster when points near each other come one after the other
+void
+PointsInLeaves(const Map_Tree& tree, std::span<const Vector3> points, std::vector<int32_t>& leaf_ids);
+
+// Sets leaves_visible[i] for every leaf potentially visible from leaf_id.
+// Everything is visible from the solid leaf 0 and in maps without vis data.
+void
+DecompressVis(const Map_Tree& tree, int32_t leaf_id, std::vector<uint8_t>& leaves_visible);
+
+// Sets nodes_visible[i] for every node with a visible leaf below it, so the other subtrees can be skipped whole
+void
+MarkVisibleNodes(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, std::vector<uint8_t>& nodes_visible);
+
+struct Frustum // Planes facing inwards, a point p is inside when dot(xyz, p) + w >= 0 for all of them
+{
+	Vector4 planes[6];
+};
+
+// Frustum in Quake coordinates from a view-projection matrix working in viewer coordinates
+Frustum
+FrustumFromMatrix(Matrix view_projection);
+
+struct Cull_Stats
+{
+	size_t nodes_visible; // Nodes and leaves at least partly inside the frustum
+	size_t nodes_culled;  // Nodes and leaves rejected, their children are never looked at
+};
+
+// Leaves both visible and inside the frustum, every visible leaf without one. Planes a node is fully inside of are
+// not tested again for its children. With an eye point, in Quake coordinates, leaves come nearest first since each
+// node is walked on the side of the eye before the other one.
+void
+CullLeaves(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, const std::vector<uint8_t>& nodes_visible,
+		   const Frustum* frustum, const Vector3* eye, std::vector<uint32_t>& leaf_ids, Cull_Stats& stats);
+
+// Whether any part of a box in Quake coordinates is inside the frustum
+bool
+BoundsInFrustum(const Frustum& frustum, const BoundingBox& bounds);
+
+// Whether a box in Quake coordinates reaches into a visible leaf, for things that are not part of the world tree
+bool
+BoundsVisible(const Map_Tree& tree, const std::vector<uint8_t>& leaves_visible, const std::vector<uint8_t>& nodes_visible,
+			  const BoundingBox& bounds);
+
+// Grid the view is split into for lighting, slices along the view depth get thicker the further they are
+constexpr int CLUSTER_COUNT_X = 16;
+constexpr int CLUSTER_COUNT_Y = 9;
+constexpr int CLUSTER_COUNT_Z = 24;
+constexpr int CLUSTER_COUNT = CLUSTER_COUNT_X * CLUSTER_COUNT_Y * CLUSTER_COUNT_Z;
+
+struct Light_Clusters // Lights that may reach into each cluster, X varying fastest then Y then Z
+{
+	float clip_near, clip_far;   // Of the projection
+	float near_depth, far_depth; // Covered by the slices, anything nearer is in the first one
+	std::vector<uint32_t> offsets; // Where the lights of each cluster start in light_ids, then where the last ones end
+	std::vector<uint32_t> light_ids;
+
+	// Scratch kept between calls so assigning does not allocate every frame
+	struct Range // Of clusters reached by a light within one depth slice
+	{
+		uint32_t light_id;
+		int z;
+		int min[2], max[2];
+	};
+	std::vector<Range> ranges;
+	std::vector<uint32_t> next; // Where the next light of each cluster goes
+};
+
+// Sorts lights, given as spheres in view space with the radius in w, into the clusters of a perspective projection
+// they may reach, bounding the sphere again within each depth slice
+void
+AssignLightClusters(std::span<const Vector4> spheres, Matrix projection, Light_Clusters& clusters);
+
+// Faces listed by the given leaves, each one once and in the order of the first leaf listing it
+void
+CollectVisibleFaces(const Map_Tree& tree, std::span<const uint32_t> leaf_ids, std::vector<uint32_t>& face_ids);
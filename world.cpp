@@ -0,0 +1,698 @@
+#include <config.h>
+#include <raylib.h>
+#include <raymath.h>
+#include <rlgl.h>
+#include <external/glad.h>
+
+#include "vis.h"
+#include "world.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <map>
+#include <span>
+
+// raylib binds its default attribute names to the first locations when linking a shader,
+// the surface id comes after them and matches the layout in lighting.vert
+constexpr unsigned int ATTRIB_LOCATION_POSITION = 0;
+constexpr unsigned int ATTRIB_LOCATION_NORMAL = 2;
+constexpr unsigned int ATTRIB_LOCATION_COLOR = 3;
+constexpr unsigned int ATTRIB_LOCATION_TEXCOORD2 = 5;
+constexpr unsigned int ATTRIB_LOCATION_SURFACE_ID = 6;
+
+static int
+MipmapCount(int width, int height)
+{
+	return 1 + (int)std::log2(std::max(width, height));
+}
+
+// Bytes of the given levels of a mip chain
+static size_t
+MipChainBytes(int width, int height, int levels, int bytes_per_pixel)
+{
+	size_t bytes = 0;
+	for (int level = 0; level < levels; ++level)
+		bytes += (size_t)std::max(width >> level, 1) * std::max(height >> level, 1) * bytes_per_pixel;
+	return bytes;
+}
+
+static Texture
+UploadTextureData(const Texture_Data& data, bool paletted)
+{
+	Image texture_image = {
+		.data = paletted ? (void*)data.indices.data() : (void*)data.pixels.data(),
+		.width = data.width,
+		.height = data.height,
+		.mipmaps = data.mipmaps,
+		.format = paletted ? PIXELFORMAT_UNCOMPRESSED_GRAYSCALE : PIXELFORMAT_UNCOMPRESSED_R8G8B8,
+	};
+	Texture texture = LoadTextureFromImage(texture_image);
+	glBindTexture(GL_TEXTURE_2D, texture.id);
+
+	// Indices can't be averaged, the chain stops at the levels the BSP stores and the shader blends them once resolved
+	if (paletted)
+	{
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, data.mipmaps - 1);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return texture;
+	}
+
+	// The BSP only stores the first levels, the GPU derives the rest of the chain from the last one
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, data.mipmaps - 1);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+
+	// Keep the texels crisp up close
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	texture.mipmaps = MipmapCount(data.width, data.height);
+	return texture;
+}
+
+template<typename T>
+static void
+ResampleNearest(const T* src, int src_width, int src_height, T* dst, int dst_width, int dst_height)
+{
+	for (int y = 0; y < dst_height; ++y)
+	{
+		const T* src_row = src + (y * src_height / dst_height) * src_width;
+		for (int x = 0; x < dst_width; ++x)
+			dst[y * dst_width + x] = src_row[x * src_width / dst_width];
+	}
+}
+
+template<typename T>
+static void
+UploadTextureArrayLayer(int layer, int level, const T* src, int src_width, int src_height, int width, int height, GLenum format, std::vector<T>& resampled)
+{
+	resampled.resize((size_t)width * height);
+	ResampleNearest(src, src_width, src_height, resampled.data(), width, height);
+	glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer, width, height, 1, format, GL_UNSIGNED_BYTE, resampled.data());
+}
+
+// Textures of the same size once rounded up to powers of two share an array
+static std::pair<int, int>
+SizeClass(const Texture_Data& texture)
+{
+	return {(int)std::bit_ceil((unsigned int)texture.width), (int)std::bit_ceil((unsigned int)texture.height)};
+}
+
+// The given textures of one size class, one per layer in that order
+static unsigned int
+UploadTextureArray(const std::vector<Texture_Data>& all_textures, std::span<const uint32_t> texture_ids, bool paletted, size_t& bytes)
+{
+	// Layers share the size of their class, the few textures that are not a power of two across are stretched to it.
+	// UVs are normalized so they still line up.
+	auto [width, height] = SizeClass(all_textures[texture_ids[0]]);
+	int stored_mipmaps = MipmapCount(width, height);
+	for (uint32_t texture_id : texture_ids)
+		stored_mipmaps = std::min(stored_mipmaps, all_textures[texture_id].mipmaps);
+	int mipmaps = paletted ? stored_mipmaps : MipmapCount(width, height);
+	GLenum internal_format = paletted ? GL_R8 : GL_RGB8;
+	GLenum format = paletted ? GL_RED : GL_RGB;
+
+	unsigned int id = 0;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, id);
+	for (int level = 0; level < mipmaps; ++level)
+		glTexImage3D(GL_TEXTURE_2D_ARRAY, level, internal_format, std::max(width >> level, 1), std::max(height >> level, 1), texture_ids.size(), 0, format, GL_UNSIGNED_BYTE, nullptr);
+	bytes += texture_ids.size() * MipChainBytes(width, height, mipmaps, paletted ? 1 : 3);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	std::vector<Color_RGB8> resampled_pixels;
+	std::vector<uint8_t> resampled_indices;
+	for (size_t layer = 0; layer < texture_ids.size(); ++layer)
+	{
+		const Texture_Data& texture = all_textures[texture_ids[layer]];
+		size_t level_offset = 0;
+		for (int level = 0; level < stored_mipmaps; ++level)
+		{
+			int src_width = std::max(texture.width >> level, 1), src_height = std::max(texture.height >> level, 1);
+			int dst_width = width >> level, dst_height = height >> level;
+			if (paletted)
+				UploadTextureArrayLayer(layer, level, texture.indices.data() + level_offset, src_width, src_height, dst_width, dst_height, format, resampled_indices);
+			else
+				UploadTextureArrayLayer(layer, level, texture.pixels.data() + level_offset, src_width, src_height, dst_width, dst_height, format, resampled_pixels);
+
+			level_offset += src_width * src_height;
+		}
+	}
+
+	if (paletted)
+	{
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, stored_mipmaps - 1);
+	}
+	else
+	{
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, stored_mipmaps - 1);
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BASE_LEVEL, 0);
+	}
+
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, paletted ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST_MIPMAP_LINEAR);
+	glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+	TraceLog(LOG_INFO, "WORLD: [ID %i] Texture array loaded successfully (%ix%i | %zu layers)", id, width, height, texture_ids.size());
+	return id;
+}
+
+static unsigned int
+UploadPalette()
+{
+	Color_RGB8 colors[256];
+	for (int id = 0; id < 256; ++id)
+		colors[id] = palette(id);
+
+	unsigned int id = 0;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, 256, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, colors);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return id;
+}
+
+static unsigned int
+UploadLightmap(const Lightmap_Data& lightmap)
+{
+	if (lightmap.pixels.empty())
+		return 0;
+
+	unsigned int id = 0;
+	glGenTextures(1, &id);
+	glBindTexture(GL_TEXTURE_2D, id);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, lightmap.width, lightmap.height, 0, GL_RED, GL_UNSIGNED_BYTE, lightmap.pixels.data());
+
+	// Luxels are blended across a face, never past its rectangle since UVs stay half a luxel inside
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	TraceLog(LOG_INFO, "WORLD: [ID %i] Lightmap atlas loaded successfully (%ix%i)", id, lightmap.width, lightmap.height);
+	return id;
+}
+
+static void
+SetVertexAttribute(unsigned int location, int components, int type, bool normalized, size_t offset)
+{
+	rlSetVertexAttribute(location, components, type, normalized, sizeof(Packed_Vertex), (const void*)offset);
+	rlEnableVertexAttribute(location);
+}
+
+struct Shader_Light // Light in lighting.frag
+{
+	Vector4 sphere; // Viewer coordinates, radius in w
+	Vector4 color;  // Light lost per viewer unit in w
+};
+
+// Creates the buffer the first time, then replaces what it holds
+static void
+FillShaderBuffer(unsigned int& buffer, const void* data, size_t size, GLenum usage)
+{
+	if (buffer == 0)
+		glGenBuffers(1, &buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(size, 4), size != 0 ? data : nullptr, usage); // Bound buffers can't be empty
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+static void
+UploadLights(World& world, const std::vector<Map_Light>& lights)
+{
+	float scale = Vector3Length(FromQuake({1, 0, 0}));
+	std::vector<Shader_Light> shader_lights;
+	for (const Map_Light& light : lights)
+	{
+		Vector3 position = FromQuake(light.position);
+		float radius = light.intensity / light.falloff * scale;
+		world.light_spheres.push_back({position.x, position.y, position.z, radius});
+		shader_lights.push_back({
+			.sphere = {position.x, position.y, position.z, radius},
+			.color = {light.color.x, light.color.y, light.color.z, light.falloff / scale},
+		});
+	}
+	FillShaderBuffer(world.light_buffer, shader_lights.data(), shader_lights.size() * sizeof(Shader_Light), GL_STATIC_DRAW);
+}
+
+// One array per size class rather than every texture stretched to the largest, classes with more textures than an
+// array has layers take several arrays
+static void
+UploadTextureArrays(World& world, const std::vector<Texture_Data>& textures, bool paletted)
+{
+	GLint max_layers = 0;
+	glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+	max_layers = std::max(max_layers, 1);
+
+	std::map<std::pair<int, int>, std::vector<uint32_t>> size_classes;
+	for (uint32_t texture_id = 0; texture_id < textures.size(); ++texture_id)
+		size_classes[SizeClass(textures[texture_id])].push_back(texture_id);
+
+	std::vector<uint32_t> layers(textures.size());
+	world.texture_array_ids.resize(textures.size());
+	for (const auto& [size, texture_ids] : size_classes)
+	{
+		for (size_t first = 0; first < texture_ids.size(); first += max_layers)
+		{
+			std::span<const uint32_t> array_texture_ids = std::span{texture_ids}.subspan(first, std::min<size_t>(max_layers, texture_ids.size() - first));
+			for (size_t layer = 0; layer < array_texture_ids.size(); ++layer)
+			{
+				world.texture_array_ids[array_texture_ids[layer]] = world.texture_arrays.size();
+				layers[array_texture_ids[layer]] = layer;
+			}
+			world.texture_arrays.push_back(UploadTextureArray(textures, array_texture_ids, paletted, world.texture_bytes));
+		}
+	}
+	FillShaderBuffer(world.texture_layer_buffer, layers.data(), layers.size() * sizeof(uint32_t), GL_STATIC_DRAW);
+}
+
+static void
+UnloadWorldTextures(World& world)
+{
+	for (Texture texture : world.textures)
+		UnloadTexture(texture);
+	world.textures.clear();
+	if (world.texture_arrays.empty() == false)
+		glDeleteTextures(world.texture_arrays.size(), world.texture_arrays.data());
+	world.texture_arrays.clear();
+	world.texture_array_ids.clear();
+	if (world.palette != 0)
+		glDeleteTextures(1, &world.palette);
+	world.palette = 0;
+	world.texture_bytes = 0;
+}
+
+void
+UploadWorldTextures(World& world, const std::vector<Texture_Data>& textures, bool paletted, bool texture_array)
+{
+	UnloadWorldTextures(world);
+	world.paletted = paletted;
+
+	if (texture_array)
+		UploadTextureArrays(world, textures, paletted);
+	if (world.texture_arrays.empty())
+	{
+		for (const Texture_Data& texture : textures)
+		{
+			world.textures.push_back(UploadTextureData(texture, paletted));
+			int levels = paletted ? texture.mipmaps : MipmapCount(texture.width, texture.height);
+			world.texture_bytes += MipChainBytes(texture.width, texture.height, levels, paletted ? 1 : 3);
+		}
+	}
+	if (paletted)
+	{
+		world.palette = UploadPalette();
+		world.texture_bytes += 256 * sizeof(Color_RGB8);
+	}
+}
+
+World
+UploadWorld(const Map_Data& data, bool paletted, bool texture_array)
+{
+	World world{};
+	const Mesh_Data& mesh = data.mesh;
+	const Packed_Mesh& packed = data.packed_mesh;
+
+	world.vao = rlLoadVertexArray();
+	rlEnableVertexArray(world.vao);
+	world.vbo = rlLoadVertexBuffer(packed.vertices.data(), packed.vertices.size() * sizeof(Packed_Vertex), false);
+	SetVertexAttribute(ATTRIB_LOCATION_POSITION, 3, GL_UNSIGNED_SHORT, true, offsetof(Packed_Vertex, position));
+	SetVertexAttribute(ATTRIB_LOCATION_SURFACE_ID, 1, GL_UNSIGNED_SHORT, false, offsetof(Packed_Vertex, surface_id));
+	SetVertexAttribute(ATTRIB_LOCATION_TEXCOORD2, 2, GL_UNSIGNED_SHORT, true, offsetof(Packed_Vertex, lightmap_texcoord));
+	SetVertexAttribute(ATTRIB_LOCATION_NORMAL, 2, GL_SHORT, true, offsetof(Packed_Vertex, normal));
+	world.ebo = rlLoadVertexBufferElement(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t), false);
+	world.index_count = mesh.indices.size();
+	rlDisableVertexArray();
+	world.vertex_bytes = packed.vertices.size() * sizeof(Packed_Vertex);
+
+	Vector3 size = Vector3Subtract(packed.bounds.max, packed.bounds.min);
+	world.position_decode = MatrixMultiply(MatrixScale(size.x, size.y, size.z), MatrixTranslate(packed.bounds.min.x, packed.bounds.min.y, packed.bounds.min.z));
+	FillShaderBuffer(world.surface_buffer, packed.surfaces.data(), packed.surfaces.size() * sizeof(Packed_Surface), GL_STATIC_DRAW);
+
+	UploadWorldTextures(world, data.textures, paletted, texture_array);
+	world.ranges = data.ranges;
+	world.lightmap = UploadLightmap(data.lightmap);
+
+	UploadLights(world, data.lights);
+	world.models = data.models;
+	world.model_instances = data.model_instances;
+	world.tree = data.tree;
+	if (world.models.empty() == false)
+		world.draw_list.assign(world.ranges.begin(), world.ranges.begin() + world.models[0].range_count);
+	world.camera_leaf = -1;
+	return world;
+}
+
+void
+UnloadWorld(World& world)
+{
+	rlUnloadVertexArray(world.vao);
+	for (unsigned int vbo : {world.vbo, world.ebo})
+		rlUnloadVertexBuffer(vbo);
+
+	UnloadWorldTextures(world);
+	if (world.lightmap != 0)
+		glDeleteTextures(1, &world.lightmap);
+	if (world.samples_query != 0)
+		glDeleteQueries(1, &world.samples_query);
+	for (unsigned int buffer : {world.surface_buffer, world.texture_layer_buffer, world.light_buffer, world.cluster_offset_buffer, world.cluster_light_buffer})
+	{
+		if (buffer != 0)
+			glDeleteBuffers(1, &buffer);
+	}
+
+	world = {};
+}
+
+void
+UpdateWorldVisibility(World& world, Vector3 position, Matrix view_projection, bool use_pvs, bool use_frustum, bool front_to_back)
+{
+	if (world.tree.nodes.empty())
+		return;
+
+	// The potentially visible set only changes with the camera leaf, the frustum changes every frame
+	int32_t leaf = use_pvs ? PointInLeaf(world.tree, ToQuake(position), world.camera_leaf_cache) : -1;
+	bool leaf_changed = leaf != world.camera_leaf || world.leaves_visible.empty();
+	if (leaf_changed)
+	{
+		world.camera_leaf = leaf;
+		DecompressVis(world.tree, std::max(leaf, 0), world.leaves_visible);
+		MarkVisibleNodes(world.tree, world.leaves_visible, world.nodes_visible);
+	}
+
+	// Instances are few, checking each one every frame is cheaper than keeping track of what moved
+	Frustum frustum = FrustumFromMatrix(view_projection);
+	world.visible_instances.clear();
+	for (uint32_t i = 0; i < world.model_instances.size(); ++i)
+	{
+		const Model_Instance& instance = world.model_instances[i];
+		const Map_Model& model = world.models[instance.model_id];
+		BoundingBox bounds = {Vector3Add(model.bounds.min, instance.origin), Vector3Add(model.bounds.max, instance.origin)};
+		if (model.range_count == 0 || (use_frustum && BoundsInFrustum(frustum, bounds) == false))
+			continue;
+		if (use_pvs && BoundsVisible(world.tree, world.leaves_visible, world.nodes_visible, bounds) == false)
+			continue;
+		world.visible_instances.push_back(i);
+	}
+
+	bool view_dependent = use_frustum || front_to_back;
+	if (leaf_changed == false && view_dependent == false && world.view_dependent == false)
+		return;
+	world.view_dependent = view_dependent;
+
+	std::vector<uint32_t>& leaf_ids = world.visible_leaf_ids;
+	std::vector<uint32_t>& face_ids = world.visible_face_ids;
+	std::vector<Draw_Range>& face_ranges = world.visible_ranges;
+	Vector3 eye = ToQuake(position);
+	CullLeaves(world.tree, world.leaves_visible, world.nodes_visible, use_frustum ? &frustum : nullptr, front_to_back ? &eye : nullptr,
+			   leaf_ids, world.cull_stats);
+	CollectVisibleFaces(world.tree, leaf_ids, face_ids);
+
+	face_ranges.clear();
+	for (uint32_t face_id : face_ids)
+	{
+		const Draw_Range& range = world.tree.face_ranges[face_id];
+		if (range.index_count != 0)
+			face_ranges.push_back(range);
+	}
+	world.visible_face_count = face_ranges.size();
+
+	// The index buffer is sorted by texture, so sorting by offset groups by texture and lines up neighbours.
+	// Front to back keeps the order of the leaves, faces still merge when they happen to be neighbours.
+	if (front_to_back == false)
+		std::sort(face_ranges.begin(), face_ranges.end(), [](const Draw_Range& a, const Draw_Range& b) { return a.first_index < b.first_index; });
+
+	world.draw_list.clear();
+	for (const Draw_Range& range : face_ranges)
+	{
+		Draw_Range* last = world.draw_list.empty() ? nullptr : &world.draw_list.back();
+		if (last && last->texture_id == range.texture_id && last->first_index + last->index_count == range.first_index)
+			last->index_count += range.index_count;
+		else
+			world.draw_list.push_back(range);
+	}
+}
+
+void
+UpdateWorldLights(World& world, Matrix view, Matrix projection)
+{
+	std::vector<Vector4>& view_spheres = world.view_spheres;
+	view_spheres.clear();
+	for (const Vector4& sphere : world.light_spheres)
+	{
+		Vector3 center = Vector3Transform({sphere.x, sphere.y, sphere.z}, view);
+		view_spheres.push_back({center.x, center.y, center.z, sphere.w});
+	}
+	AssignLightClusters(view_spheres, projection, world.light_clusters);
+
+	const Light_Clusters& clusters = world.light_clusters;
+	world.max_cluster_lights = 0;
+	for (int i = 0; i < CLUSTER_COUNT; ++i)
+		world.max_cluster_lights = std::max<size_t>(world.max_cluster_lights, clusters.offsets[i + 1] - clusters.offsets[i]);
+
+	FillShaderBuffer(world.cluster_offset_buffer, clusters.offsets.data(), clusters.offsets.size() * sizeof(uint32_t), GL_STREAM_DRAW);
+	FillShaderBuffer(world.cluster_light_buffer, clusters.light_ids.data(), clusters.light_ids.size() * sizeof(uint32_t), GL_STREAM_DRAW);
+}
+
+// One call for every range, they are drawn in order
+static void
+DrawRanges(World& world, std::span<const Draw_Range> ranges)
+{
+	std::vector<GLsizei>& counts = world.draw_counts;
+	std::vector<const void*>& offsets = world.draw_offsets;
+	counts.clear();
+	offsets.clear();
+	for (const Draw_Range& range : ranges)
+	{
+		counts.push_back(range.index_count);
+		offsets.push_back((const void*)(range.first_index * sizeof(uint32_t)));
+	}
+	glMultiDrawElements(GL_TRIANGLES, counts.data(), GL_UNSIGNED_INT, offsets.data(), ranges.size());
+}
+
+// What a range is drawn with, its texture or the texture array holding it
+static uint32_t
+BindingOf(const World& world, uint32_t texture_id)
+{
+	return world.texture_arrays.empty() ? texture_id : world.texture_array_ids[texture_id];
+}
+
+// On the active texture slot, the texture array one when there are arrays
+static void
+BindTextures(const World& world, uint32_t binding)
+{
+	if (world.texture_arrays.empty())
+		rlEnableTexture(world.textures[binding].id);
+	else
+		glBindTexture(GL_TEXTURE_2D_ARRAY, world.texture_arrays[binding]);
+}
+
+// Every visible instance moved to where it is, the matrices of the world are set back after them.
+// When binding textures, neighbouring ranges of a model drawn with the same binding share a call.
+static void
+DrawModelInstances(World& world, int mvp_loc, int model_loc, Matrix view_projection, bool bind_textures)
+{
+	for (uint32_t instance_id : world.visible_instances)
+	{
+		const Model_Instance& instance = world.model_instances[instance_id];
+		const Map_Model& model = world.models[instance.model_id];
+		Vector3 offset = FromQuake(instance.origin);
+		Matrix transform = MatrixMultiply(world.position_decode, MatrixTranslate(offset.x, offset.y, offset.z));
+		rlSetUniformMatrix(mvp_loc, MatrixMultiply(transform, view_projection));
+		rlSetUniformMatrix(model_loc, transform);
+
+		std::span<const Draw_Range> ranges = std::span{world.ranges}.subspan(model.first_range, model.range_count);
+		if (bind_textures == false)
+		{
+			DrawRanges(world, ranges);
+			continue;
+		}
+		for (size_t first = 0, count = 0; first < ranges.size(); first += count)
+		{
+			uint32_t binding = BindingOf(world, ranges[first].texture_id);
+			for (count = 1; first + count < ranges.size() && BindingOf(world, ranges[first + count].texture_id) == binding; ++count)
+				;
+			BindTextures(world, binding);
+			DrawRanges(world, ranges.subspan(first, count));
+		}
+	}
+	if (world.visible_instances.empty() == false)
+	{
+		rlSetUniformMatrix(mvp_loc, MatrixMultiply(world.position_decode, view_projection));
+		rlSetUniformMatrix(model_loc, world.position_decode);
+	}
+}
+
+// Reads the last query if the GPU is done with it, then starts counting the samples of this draw unless it is still pending
+static bool
+BeginSamplesQuery(World& world)
+{
+	if (world.samples_query == 0)
+		glGenQueries(1, &world.samples_query);
+
+	if (world.samples_query_pending)
+	{
+		GLuint available = 0;
+		glGetQueryObjectuiv(world.samples_query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available == 0)
+			return false;
+
+		GLuint64 samples = 0;
+		glGetQueryObjectui64v(world.samples_query, GL_QUERY_RESULT, &samples);
+		world.overdraw = world.query_viewport_samples != 0 ? float(samples) / world.query_viewport_samples : 0;
+		world.samples_query_pending = false;
+	}
+
+	GLint viewport[4] = {}, samples_per_pixel = 0;
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glGetIntegerv(GL_SAMPLES, &samples_per_pixel);
+	world.query_viewport_samples = (uint64_t)viewport[2] * viewport[3] * std::max(samples_per_pixel, 1);
+
+	glBeginQuery(GL_SAMPLES_PASSED, world.samples_query);
+	return true;
+}
+
+void
+DrawWorld(World& world, Shader shader, bool use_dynamic_lights)
+{
+	if (world.index_count == 0)
+		return;
+
+	rlDrawRenderBatchActive(); // Anything raylib batched so far goes first
+	rlEnableShader(shader.id);
+	bool querying = BeginSamplesQuery(world);
+
+	// Packed positions go from 0 to 1 between the bounds of the world, the model matrix scales them back
+	Matrix view_projection = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+	rlSetUniformMatrix(shader.locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(world.position_decode, view_projection));
+	rlSetUniformMatrix(shader.locs[SHADER_LOC_MATRIX_MODEL], world.position_decode);
+	rlSetUniformMatrix(shader.locs[SHADER_LOC_MATRIX_NORMAL], MatrixIdentity());
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, world.surface_buffer); // Bound in lighting.vert
+
+	int texture_array_enabled = world.texture_arrays.empty() == false;
+	glUniform1i(glGetUniformLocation(shader.id, "useTextureArray"), texture_array_enabled);
+	if (texture_array_enabled)
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, world.texture_layer_buffer); // Bound in lighting.frag
+	glUniform1i(glGetUniformLocation(shader.id, "usePalette"), world.paletted);
+
+	// Bound in lighting.frag
+	int dynamic_lights_enabled = use_dynamic_lights && world.cluster_offset_buffer != 0;
+	glUniform1i(glGetUniformLocation(shader.id, "useDynamicLights"), dynamic_lights_enabled);
+	if (dynamic_lights_enabled)
+	{
+		const Light_Clusters& clusters = world.light_clusters;
+		GLint viewport[4] = {};
+		glGetIntegerv(GL_VIEWPORT, viewport);
+		glUniform3i(glGetUniformLocation(shader.id, "clusterGrid"), CLUSTER_COUNT_X, CLUSTER_COUNT_Y, CLUSTER_COUNT_Z);
+		glUniform2f(glGetUniformLocation(shader.id, "clusterDepths"), clusters.near_depth, clusters.far_depth);
+		glUniform2f(glGetUniformLocation(shader.id, "clipPlanes"), clusters.clip_near, clusters.clip_far);
+		glUniform4f(glGetUniformLocation(shader.id, "viewport"), viewport[0], viewport[1], viewport[2], viewport[3]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, world.light_buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, world.cluster_offset_buffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, world.cluster_light_buffer);
+	}
+
+	glActiveTexture(GL_TEXTURE2); // Bound in lighting.frag
+	glBindTexture(GL_TEXTURE_2D, world.lightmap);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, world.palette);
+	glActiveTexture(GL_TEXTURE0);
+
+	rlEnableVertexArray(world.vao);
+	{
+		// Ranges of each texture or array keep their order, so a front to back list stays front to back within one
+		size_t binding_count = texture_array_enabled ? world.texture_arrays.size() : world.textures.size();
+		std::vector<Draw_Range>& texture_ranges = world.texture_ranges;
+		std::vector<uint32_t>& texture_order = world.texture_order;
+		std::vector<uint32_t>& texture_counts = world.texture_counts;
+		texture_order.clear();
+		texture_counts.assign(binding_count + 1, 0);
+		for (const Draw_Range& range : world.draw_list)
+		{
+			uint32_t binding = BindingOf(world, range.texture_id);
+			if (texture_counts[binding + 1]++ == 0)
+				texture_order.push_back(binding);
+		}
+		for (size_t i = 1; i < texture_counts.size(); ++i)
+			texture_counts[i] += texture_counts[i - 1];
+		texture_ranges.resize(world.draw_list.size());
+		for (const Draw_Range& range : world.draw_list)
+			texture_ranges[texture_counts[BindingOf(world, range.texture_id)]++] = range;
+
+		// Each count now ends its binding, which starts where the previous one ends
+		glActiveTexture(texture_array_enabled ? GL_TEXTURE1 : GL_TEXTURE0); // The array is bound in lighting.frag
+		std::span<const Draw_Range> ranges = texture_ranges;
+		for (uint32_t binding : texture_order)
+		{
+			uint32_t first = binding == 0 ? 0 : texture_counts[binding - 1];
+			BindTextures(world, binding);
+			DrawRanges(world, ranges.subspan(first, texture_counts[binding] - first));
+		}
+		DrawModelInstances(world, shader.locs[SHADER_LOC_MATRIX_MVP], shader.locs[SHADER_LOC_MATRIX_MODEL], view_projection, true);
+		if (texture_array_enabled)
+			glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+		else
+			rlDisableTexture();
+		glActiveTexture(GL_TEXTURE0);
+	}
+	rlDisableVertexArray();
+
+	if (querying)
+	{
+		glEndQuery(GL_SAMPLES_PASSED);
+		world.samples_query_pending = true;
+	}
+
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE3);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE0);
+	rlDisableShader();
+}
+
+void
+DrawWorldWires(World& world, Color color)
+{
+	if (world.index_count == 0)
+		return;
+
+	rlDrawRenderBatchActive();
+	rlEnableShader(rlGetShaderIdDefault());
+
+	int* locs = rlGetShaderLocsDefault();
+	Matrix view_projection = MatrixMultiply(rlGetMatrixModelview(), rlGetMatrixProjection());
+	rlSetUniformMatrix(locs[SHADER_LOC_MATRIX_MVP], MatrixMultiply(world.position_decode, view_projection));
+	Vector4 diffuse = ColorNormalize(color);
+	rlSetUniform(locs[SHADER_LOC_COLOR_DIFFUSE], &diffuse, RL_SHADER_UNIFORM_VEC4, 1);
+
+	rlActiveTextureSlot(0);
+	rlEnableTexture(rlGetTextureIdDefault());
+	rlEnableVertexArray(world.vao);
+	glVertexAttrib4f(ATTRIB_LOCATION_COLOR, 1.f, 1.f, 1.f, 1.f); // The world has no vertex colors
+
+	rlEnableWireMode();
+	DrawRanges(world, world.draw_list);
+	DrawModelInstances(world, locs[SHADER_LOC_MATRIX_MVP], -1, view_projection, false);
+	rlDisableWireMode();
+
+	rlDisableVertexArray();
+	rlDisableTexture();
+	rlDisableShader();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "bsp.h"
+#include "vis.h"
+
+#include <raylib.h>
+
+#include <vector>
+
+struct World // GPU side of a loaded map
+{
+	unsigned int vao;
+	unsigned int vbo; // Packed_Vertex
+	unsigned int ebo;
+	uint32_t index_count;
+	Matrix position_decode;      // From packed positions to viewer coordinates, the model matrix of the world
+	unsigned int surface_buffer; // Shader storage, Packed_Surface
+	size_t vertex_bytes;
+
+	std::vector<Texture> textures; // Empty when the texture array is uploaded instead
+	std::vector<Draw_Range> ranges; // Of every model, Map_Model::first_range tells where each one starts
+
+	// Brush models drawn where their instance is, an origin can change every frame without touching the buffers
+	std::vector<Map_Model> models;
+	std::vector<Model_Instance> model_instances;
+	std::vector<uint32_t> visible_instances;
+
+	// Textures stacked in arrays by size, rounded up to powers of two, so the world takes a draw call per size.
+	// Only one of textures and texture_arrays is uploaded at a time, none when drawing per texture.
+	std::vector<unsigned int> texture_arrays;
+	std::vector<uint32_t> texture_array_ids; // Per texture, which of texture_arrays holds it
+	unsigned int texture_layer_buffer;       // Shader storage, the layer of each texture in its array
+
+	unsigned int lightmap; // Single channel atlas sampled with the second UV channel
+
+	// Paletted textures hold the palette indices, the shader looks their color up in the palette texture
+	bool paletted;
+	unsigned int palette; // 256x1, 0 unless paletted
+	size_t texture_bytes; // Video memory taken by the textures or the texture arrays
+
+	// What gets drawn this frame, sorted by texture or front to back
+	Map_Tree tree;
+	std::vector<Draw_Range> draw_list;
+	int32_t camera_leaf;          // -1 when the potentially visible sets are not used
+	Leaf_Cache camera_leaf_cache;
+	size_t visible_face_count;
+	std::vector<uint8_t> leaves_visible, nodes_visible;
+	// Rebuilt every frame, kept so drawing does not allocate
+	std::vector<uint32_t> visible_leaf_ids, visible_face_ids;
+	std::vector<Draw_Range> visible_ranges; // Before neighbours are merged into the draw list
+	std::vector<Draw_Range> texture_ranges; // The draw list grouped by texture or texture array
+	std::vector<uint32_t> texture_order, texture_counts;
+	std::vector<int32_t> draw_counts; // Arguments of a multi draw call
+	std::vector<const void*> draw_offsets;
+	bool view_dependent;          // The draw list depends on the view and is rebuilt every frame
+	Cull_Stats cull_stats;
+
+	// Light entities, sorted into clusters of the view every frame so fragments only go through the lights reaching them
+	std::vector<Vector4> light_spheres; // Viewer coordinates, radius in w
+	std::vector<Vector4> view_spheres;  // The same in view space, rebuilt every frame
+	Light_Clusters light_clusters;
+	unsigned int light_buffer;          // Shader storage, every light
+	unsigned int cluster_offset_buffer, cluster_light_buffer; // Shader storage, written every frame
+	size_t max_cluster_lights;          // Most lights a cluster has this frame
+
+	// Samples that passed the depth test while drawing, per sample of the viewport, read a frame late
+	unsigned int samples_query;
+	bool samples_query_pending;
+	uint64_t query_viewport_samples;
+	float overdraw;
+};
+
+// Must be called from the thread owning the GL context
+World
+UploadWorld(const Map_Data& data, bool paletted, bool texture_array);
+
+// Replaces the textures of the world, with colors or with palette indices, either one texture each or
+// texture arrays holding the textures of each size
+void
+UploadWorldTextures(World& world, const std::vector<Texture_Data>& textures, bool paletted, bool texture_array);
+
+void
+UnloadWorld(World& world);
+
+// Rebuilds the draw list from the potentially visible set of the leaf containing position, given in
+// viewer coordinates, and what of it is inside the view frustum. Front to back, faces nearer to the
+// camera come first so the depth test rejects what they hide before it is shaded, otherwise they are
+// sorted by texture. Nothing is done while the camera stays in the same leaf unless the list depends
+// on the view. Brush model instances are culled by their bounds every frame since they can move.
+void
+UpdateWorldVisibility(World& world, Vector3 position, Matrix view_projection, bool use_pvs, bool use_frustum, bool front_to_back);
+
+// Sorts the lights of the world into the clusters of the view, with the matrices the next DrawWorld uses
+void
+UpdateWorldLights(World& world, Matrix view, Matrix projection);
+
+// Draws with the current 3D mode matrices, one call per texture array when the world has them, otherwise one call per texture.
+// Textures or arrays are drawn in the order they first appear in the draw list.
+// Visible brush model instances follow the world, one call per instance and texture or array.
+// Dynamic lights replace the lightmaps with the lights UpdateWorldLights sorted, without shadows.
+void
+DrawWorld(World& world, Shader shader, bool use_dynamic_lights);
+
+void
+DrawWorldWires(World& world, Color color);